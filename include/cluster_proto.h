@@ -0,0 +1,233 @@
+#pragma once
+// 複数ボードのクラスタ: パケット形式と、受信した状態の取り込み処理
+// Arduino の API を使わないので、test/ のネイティブテストからもそのままビルドできる
+// （送受信・時刻・変更履歴への記録は呼び出し側が渡す）
+
+#include <stdint.h>
+#include <stddef.h>
+
+// パケット形式（リトルエンディアン）
+//   ヘッダー: "MDC" + 形式バージョン(1) + 種別(1) + 送信元ボード番号(1) + 件数(1)
+//   STATE:    件数 × [部屋番号(2) 担当ボード(1) マスク(2) バージョン(4)]
+//   COMMAND:  1件 [部屋番号(2) 区画(1, 0=全解除) 操作(1, 1=set 0=clear)]
+const uint8_t CLUSTER_MSG_STATE = 1;
+const uint8_t CLUSTER_MSG_COMMAND = 2;
+const int CLUSTER_HEADER_SIZE = 7;
+const int CLUSTER_ENTRY_SIZE = 9;
+const int CLUSTER_COMMAND_SIZE = 4;
+
+// 他のボードが担当する部屋の最新状態
+struct ClusterRoom {
+  bool used;
+  int room;               // 部屋番号
+  uint8_t owner;          // 担当ボードの番号
+  uint16_t mask;          // bit (n-1) = 区画 n がハイライト
+  uint32_t version;       // 担当ボードが付けたバージョン
+  unsigned long lastSeen; // 担当ボードから最後に受信した時刻 (millis)
+};
+const int CLUSTER_MAX_ROOMS = 8;
+
+// 1台のボードのクラスタの状態
+struct ClusterNode {
+  uint8_t id;                           // このボードの番号
+  const int* localRooms;                // 担当する部屋
+  int localRoomCount;
+  uint32_t* localVersion;               // 担当する部屋のバージョン（localRooms と同じ順）
+  ClusterRoom rooms[CLUSTER_MAX_ROOMS]; // 他のボードが担当する部屋
+  bool dirty;                           // 未送信の変更があるか
+};
+
+// 他ボードの部屋の区画が変化したときに呼ばれる（box = -1 は全解除）
+typedef void (*ClusterChangeFn)(int room, int box, bool set);
+
+inline void putU16(uint8_t* p, uint16_t v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+inline void putU32(uint8_t* p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xFF; }
+inline uint16_t getU16(const uint8_t* p) { return p[0] | ((uint16_t)p[1] << 8); }
+inline uint32_t getU32(const uint8_t* p) {
+  return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief パケットヘッダーを書き込む
+ */
+inline void clusterHeader(uint8_t* buf, uint8_t type, uint8_t nodeId, uint8_t count) {
+  buf[0] = 'M';
+  buf[1] = 'D';
+  buf[2] = 'C';
+  buf[3] = 1;
+  buf[4] = type;
+  buf[5] = nodeId;
+  buf[6] = count;
+}
+
+/**
+ * @brief 受信したパケットのヘッダーを確認する
+ * @return true: クラスタのパケット（type・sender・count に値を返す）
+ */
+inline bool clusterParseHeader(const uint8_t* buf, int len, uint8_t &type, uint8_t &sender, int &count) {
+  if (len < CLUSTER_HEADER_SIZE || buf[0] != 'M' || buf[1] != 'D' || buf[2] != 'C' || buf[3] != 1) {
+    return false;
+  }
+  type = buf[4];
+  sender = buf[5];
+  count = buf[6];
+  return true;
+}
+
+/**
+ * @brief STATE パケットの最大長（担当する部屋 + 他ボードの部屋）
+ */
+inline size_t clusterStateSize(const ClusterNode &node) {
+  return CLUSTER_HEADER_SIZE + (node.localRoomCount + CLUSTER_MAX_ROOMS) * CLUSTER_ENTRY_SIZE;
+}
+
+/**
+ * @brief 知っている全部屋（担当する部屋 + 他ボードの部屋）の STATE パケットを組み立てる
+ * @param node このボードの状態
+ * @param localMasks 担当する部屋の現在のマスク（localRooms と同じ順）
+ * @param buf 出力先（clusterStateSize() 以上）
+ * @return パケットの長さ
+ *
+ * 他ボードの部屋も中継するので、再起動したボードは自分の古いバージョンを知ることができる。
+ */
+inline size_t clusterEncodeState(const ClusterNode &node, const uint16_t* localMasks, uint8_t* buf) {
+  uint8_t* p = buf + CLUSTER_HEADER_SIZE;
+  uint8_t count = 0;
+
+  for (int i = 0; i < node.localRoomCount; i++) {
+    putU16(p, node.localRooms[i]);
+    p[2] = node.id;
+    putU16(p + 3, localMasks[i]);
+    putU32(p + 5, node.localVersion[i]);
+    p += CLUSTER_ENTRY_SIZE;
+    count++;
+  }
+  for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+    const ClusterRoom &cr = node.rooms[r];
+    if (!cr.used) continue;
+    putU16(p, cr.room);
+    p[2] = cr.owner;
+    putU16(p + 3, cr.mask);
+    putU32(p + 5, cr.version);
+    p += CLUSTER_ENTRY_SIZE;
+    count++;
+  }
+
+  clusterHeader(buf, CLUSTER_MSG_STATE, node.id, count);
+  return p - buf;
+}
+
+/**
+ * @brief 受信した部屋の状態を取り込む（より新しいバージョンのみ採用）
+ * @param node このボードの状態
+ * @param sender 送信元ボードの番号
+ * @param room 部屋番号
+ * @param owner 担当ボードの番号
+ * @param mask 区画のビットマスク
+ * @param version バージョン
+ * @param now 現在時刻 (millis)
+ * @param onChange 変化した区画ごとに呼ぶ（nullptr 可）
+ */
+inline void clusterMergeRoom(ClusterNode &node, uint8_t sender, int room, uint8_t owner,
+                             uint16_t mask, uint32_t version, unsigned long now,
+                             ClusterChangeFn onChange) {
+  if (owner == node.id) {
+    // 自分の部屋について、再起動前の自分が配った新しいバージョンが残っている場合は
+    // それより大きなバージョンで現在の状態を配り直す
+    // （現在のバージョンがそのまま中継されてきただけなら何もしない）
+    for (int i = 0; i < node.localRoomCount; i++) {
+      if (node.localRooms[i] == room && version > node.localVersion[i]) {
+        node.localVersion[i] = version + 1;
+        node.dirty = true;
+      }
+    }
+    return;
+  }
+
+  int slot = -1;
+  for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+    if (node.rooms[r].used && node.rooms[r].room == room) {
+      slot = r;
+      break;
+    }
+    if (slot == -1 && !node.rooms[r].used) slot = r;
+  }
+  if (slot == -1) {
+    return; // 部屋が多すぎる
+  }
+
+  ClusterRoom &cr = node.rooms[slot];
+  bool known = cr.used && cr.room == room;
+  bool direct = (sender == owner);
+  if (!known && !direct) {
+    // 中継だけで知った部屋は覚えない（止まったボードの部屋が中継で生き返らないように）
+    return;
+  }
+  if (direct) {
+    cr.lastSeen = now;
+  }
+  if (known && version <= cr.version) {
+    return; // 古い、または同じ情報
+  }
+
+  // 変化した区画を知らせる（通知は担当ボードが行うので、呼び出し側は変更履歴への記録のみ）
+  uint16_t oldMask = known ? cr.mask : 0;
+  uint16_t diff = oldMask ^ mask;
+  for (int b = 0; b < 16; b++) {
+    if (onChange != nullptr && (diff & ((uint16_t)1 << b))) onChange(room, b + 1, (mask >> b) & 1);
+  }
+
+  cr.used = true;
+  cr.room = room;
+  cr.owner = owner;
+  cr.mask = mask;
+  cr.version = version;
+}
+
+/**
+ * @brief STATE パケットの全エントリを取り込む
+ * @param node このボードの状態
+ * @param buf 受信したパケット（ヘッダーを含む）
+ * @param len パケットの長さ
+ * @param now 現在時刻 (millis)
+ * @param onChange 変化した区画ごとに呼ぶ（nullptr 可）
+ * @return true: 自分以外のボードからの STATE パケットだった
+ */
+inline bool clusterMergeState(ClusterNode &node, const uint8_t* buf, int len, unsigned long now,
+                              ClusterChangeFn onChange) {
+  uint8_t type, sender;
+  int count;
+  if (!clusterParseHeader(buf, len, type, sender, count) ||
+      type != CLUSTER_MSG_STATE || sender == node.id) {
+    return false;
+  }
+  const uint8_t* p = buf + CLUSTER_HEADER_SIZE;
+  for (int i = 0; i < count && p + CLUSTER_ENTRY_SIZE <= buf + len; i++) {
+    clusterMergeRoom(node, sender, getU16(p), p[2], getU16(p + 3), getU32(p + 5), now, onChange);
+    p += CLUSTER_ENTRY_SIZE;
+  }
+  return true;
+}
+
+/**
+ * @brief 担当ボードから timeout の間届いていない部屋を消す
+ * @param node このボードの状態
+ * @param now 現在時刻 (millis)
+ * @param timeout 部屋を消すまでの時間 (ms)
+ * @param onChange 表示中の区画があった部屋は box = -1（全解除）で呼ぶ（nullptr 可）
+ * @return 消した部屋の数
+ */
+inline int clusterExpireRooms(ClusterNode &node, unsigned long now, unsigned long timeout,
+                              ClusterChangeFn onChange) {
+  int expired = 0;
+  for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+    ClusterRoom &cr = node.rooms[r];
+    if (!cr.used || now - cr.lastSeen < timeout) continue;
+    if (cr.mask != 0 && onChange != nullptr) {
+      onChange(cr.room, -1, false);
+    }
+    cr.used = false;
+    expired++;
+  }
+  return expired;
+}
@@ -1,6 +1,11 @@
 #include "WiFiS3.h"
+#include "WiFiUdp.h"
+#include "Arduino_LED_Matrix.h"
+#include <EEPROM.h>
+#include <malloc.h>
 #include "arduino_secrets.h" 
 #include "style.h" // ★ html_content.h の代わりに style.h をインクルード
+#include "cluster_proto.h"
 
 char ssid[] = SECRET_SSID;
 char pass[] = SECRET_PASS;
@@ -87,6 +92,58 @@ const int ROOM301_NEW_TO_PIN[17] = {
   -1   // 新しい区画16 → なし
 };
 
+// --- ★ 部屋のレイアウト表（ページの描画用） ---
+// グリッドのセルを行優先で並べる: 正の数 = 区画番号、0 (CELL_EMPTY) = 空の四角（▫️）、
+// -1 (CELL_NONE) = 何も表示しない位置。部屋の追加や並べ替えはこの表を変えるだけでよい
+const int8_t CELL_EMPTY = 0;
+const int8_t CELL_NONE = -1;
+
+struct RoomLayout {
+  int room;              // 部屋番号
+  uint8_t cols;          // 列数
+  uint8_t rows;          // 行数
+  uint8_t cellWidth;     // 四角の幅 (px)
+  const int8_t* cells;   // cols × rows 個のセル（行優先）
+};
+
+// 2-301（3列 × 8行）
+const int8_t ROOM301_CELLS[3 * 8] = {
+    1,  -1,   3,
+    2,  10,   4,
+    0,  -1,   0,
+    8,   9,   5,
+   12,  -1,   0,
+   -1,  -1,  -1,
+    0,  -1,   0,
+   11,  -1,   6,
+};
+
+// 2-302（5列 × 7行）
+const int8_t ROOM302_CELLS[5 * 7] = {
+    1,  -1,   0,   0,   5,
+    2,  -1,  -1,  -1,   6,
+    0,  -1,   0,  -1,   0,
+    3,  -1,  -1,  -1,   7,
+    0,  -1,  -1,  -1,   0,
+    0,  -1,  -1,  -1,   0,
+    0,   0,   4,   0,   0,
+};
+
+// クラスタの他ボードの部屋など、レイアウト表がない部屋用（4列 × 4行で区画1~16）
+const int8_t DEFAULT_CELLS[4 * 4] = {
+    1,   2,   3,   4,
+    5,   6,   7,   8,
+    9,  10,  11,  12,
+   13,  14,  15,  16,
+};
+
+const RoomLayout ROOM_LAYOUTS[] = {
+  {301, 3, 8, 80, ROOM301_CELLS},
+  {302, 5, 7, 60, ROOM302_CELLS},
+};
+const int ROOM_LAYOUT_COUNT = sizeof(ROOM_LAYOUTS) / sizeof(ROOM_LAYOUTS[0]);
+const RoomLayout DEFAULT_ROOM_LAYOUT = {0, 4, 4, 80, DEFAULT_CELLS};
+
 // 2-302室のタクトスイッチ（既存の設定を維持、必要に応じて拡張可能）
 const int BTN3_PIN = 4; // 302号室: 左4
 const int BTN4_PIN = 5; // 302号室: 右2
@@ -124,22 +181,599 @@ const unsigned long debounceDelay = 50; // 50ms のデバウンス時間
 // cc:tweakedコンピュータのIPアドレスとポートを設定してください
 // 例: IPAddress cctweaked_ip(192, 168, 1, 100);
 // デフォルトは空（使用しない場合はコメントアウト）
+// ここで設定した相手は起動時に通知先（サブスクライバー）として登録される
+// （WebSocket で接続している間は POST を送らない。下の WebSocket プッシュ設定を参照）
 IPAddress cctweaked_ip; // 使用する場合は setup() で設定してください
 int cctweaked_port = 8080; // cc:tweakedのHTTPサーバーポート
 
+// --- ★ WebSocket プッシュ設定 ---
+// CC:Tweaked から http.websocket("ws://<このボードのIP>:81/") で接続すると、
+// 状態変化ごとに小さなテキストフレーム（POST と同じ JSON）が1本の接続で届く
+// WebSocket クライアントが1台以上接続している間は、cctweaked_ip への HTTP POST の代わりに
+// こちらを使う（同じ CC:Tweaked に二重に届かないように）。/api/subscribers で登録した
+// 通知先には WebSocket の接続とは関係なく POST を送る
+bool wsPushEnabled = true;   // 使用しない場合は false
+const int WS_PORT = 81;
+WiFiServer wsServer(WS_PORT);
+
+const int WS_MAX_CLIENTS = 2;
+enum WsClientState {
+  WS_FREE,       // 未使用
+  WS_HANDSHAKE,  // ハンドシェイク要求の受信中
+  WS_OPEN        // 接続確立済み（フレーム送信可能）
+};
+struct WsClient {
+  WiFiClient client;
+  WsClientState state;
+  unsigned long since;  // 状態に入った時刻 (millis)
+  char line[64];        // ハンドシェイク中のヘッダー1行（長い行は切り詰める）
+  int lineLen;
+  char key[32];         // Sec-WebSocket-Key の値
+};
+WsClient wsClients[WS_MAX_CLIENTS];
+const unsigned long WS_HANDSHAKE_TIMEOUT = 2000; // ハンドシェイク完了までの待ち時間
+
 // --- 状態変化検出用の前回の状態 ---
 bool prevBox302State[16] = {false, false, false, false, false, false, false, false,
                              false, false, false, false, false, false, false, false};
 bool prevBox301State[16] = {false, false, false, false, false, false, false, false,
                              false, false, false, false, false, false, false, false};
 
+// --- ★ WiFi 接続ステートマシン ---
+// setup() では接続を待たず、loop() から少しずつ接続処理を進める
+// （ボタンのスキャンと状態の記録は起動直後から動作させるため）
+// WiFi.begin() は既定では接続完了まで最大10秒ライブラリ内で待つため、
+// setTimeout() で待ち時間をなくし、接続の完了は status() のポーリングで確認する
+enum WifiState {
+  WIFI_STATE_CHECK_MODULE, // WiFiモジュールの確認・固定IP設定
+  WIFI_STATE_CONNECTING,   // 次の接続試行の時刻待ち / 接続試行の開始
+  WIFI_STATE_JOINING,      // 接続試行中（status() で完了を確認する）
+  WIFI_STATE_CONNECTED     // 接続済み（サーバー稼働中）
+};
+WifiState wifiState = WIFI_STATE_CHECK_MODULE;
+unsigned long wifiNextActionTime = 0;   // 次に接続処理を行う時刻 (millis)
+unsigned long wifiBackoff = 0;          // 現在のリトライ間隔 (ms)
+unsigned long wifiJoinStart = 0;        // 現在の接続試行を始めた時刻 (millis)
+
+const unsigned long WIFI_BACKOFF_MIN = 500;        // 初回リトライ間隔 500ms
+const unsigned long WIFI_BACKOFF_MAX = 8000;       // リトライ間隔の上限 8秒
+const unsigned long WIFI_BEGIN_TIMEOUT = 0;        // WiFi.begin() がライブラリ内で待つ時間（待たない）
+const unsigned long WIFI_JOIN_TIMEOUT = 10000;     // 1回の接続試行の上限 10秒
+const unsigned long WIFI_JOIN_POLL = 250;          // 接続試行中に status() を確認する間隔
+const unsigned long WIFI_MODULE_RETRY = 5000;      // モジュールが見つからない場合の再確認間隔
+const unsigned long LINK_CHECK_INTERVAL = 2000;    // 接続中のリンク監視間隔 2秒
+
+// --- ★ リンク監視のカウンタ ---
+unsigned long linkDownCount = 0;       // リンク切断を検出した回数
+unsigned long reconnectCount = 0;      // 切断後に再接続できた回数
+unsigned long linkDowntimeTotal = 0;   // 切断していた時間の合計 (ms)
+unsigned long linkDownSince = 0;       // 現在の切断が始まった時刻（0 = 切断中ではない）
+unsigned long scanGapOfflineMaxUs = 0; // 未接続の間のボタンスキャン間隔の最大値（接続処理の影響の確認用）
+
+// --- ★ WebSocket 通知キュー ---
+// WebSocket の接続先へまとめて流すためのキュー（HTTP の通知先は下のサブスクライバーごとのキューを使う）
+struct NotifyEvent {
+  char room[4];   // 部屋番号 ("301" / "302")
+  int box;        // 区画番号 (1-16、-1の場合は全解除)
+  bool set;       // true: "set", false: "clear"
+  unsigned long time; // キューに入れた時刻 (millis)
+};
+const int NOTIFY_QUEUE_SIZE = 16;
+NotifyEvent notifyQueue[NOTIFY_QUEUE_SIZE];
+int notifyHead = 0;           // 次に送信するイベントの位置
+int notifyCount = 0;          // キュー内のイベント数
+unsigned long notifyDropped = 0; // キューが満杯で破棄したイベント数（全キューの合計）
+
+// --- ★ 通知先の登録（サブスクライバー） ---
+// 状態変化を HTTP POST で知らせる相手を、実行中に /api/subscribers で登録・削除できる
+// 通知先ごとにキューと再試行の待ち時間を持ち、応答も待たずに次の処理へ進むので、
+// 遅い相手や落ちている相手がいても他の通知先への配信は遅れない
+// 登録内容は EEPROM に保存し、再起動後も引き継ぐ
+// 登録・削除には X-Admin-Token ヘッダーが SECRET_ADMIN_TOKEN（arduino_secrets.h）と一致する必要がある
+// トンネル経由の通信も LAN 内の cloudflared から届くため、送信元IPでは区別できない
+// SECRET_ADMIN_TOKEN を定義していなければ登録・削除は受け付けない（一覧の取得はできる）
+#ifndef SECRET_ADMIN_TOKEN
+#define SECRET_ADMIN_TOKEN ""
+#endif
+const char ADMIN_TOKEN[] = SECRET_ADMIN_TOKEN;
+const int SUBSCRIBER_MAX = 4;
+const int SUBSCRIBER_QUEUE_SIZE = 8;
+const int SUBSCRIBER_PATH_MAX = 24;
+const unsigned long SUBSCRIBER_TIMEOUT = 5000;      // 応答待ちの上限 (ms)
+const int SUBSCRIBER_STATUS_LEN = 12;               // 判定に使うステータス行の長さ（"HTTP/1.1 200"）
+const unsigned long SUBSCRIBER_BACKOFF_MIN = 1000;  // 失敗後の再試行までの待ち時間（倍々に延ばす）
+const unsigned long SUBSCRIBER_BACKOFF_MAX = 30000;
+enum SubscriberState {
+  SUB_IDLE,      // 送信待ちのイベントがあれば接続する
+  SUB_WAITING    // 送信済みで応答を待っている
+};
+struct Subscriber {
+  bool used;
+  IPAddress ip;
+  uint16_t port;
+  char path[SUBSCRIBER_PATH_MAX]; // POST 先のパス
+  bool persistent;                // EEPROM に保存するか（cctweaked_ip から作ったものは保存しない）
+  bool wsReplaces;                // WebSocket の接続中は送らない（cctweaked_ip から作ったもの）
+  NotifyEvent queue[SUBSCRIBER_QUEUE_SIZE];
+  int head;
+  int count;
+  SubscriberState state;
+  WiFiClient client;
+  unsigned long sentAt;           // 送信した時刻 (millis)
+  char status[SUBSCRIBER_STATUS_LEN]; // 受信したステータス行の先頭（分割して届くことがあるので貯める）
+  int statusLen;
+  unsigned long nextAttempt;      // 次に接続してよい時刻 (millis)
+  unsigned long backoff;          // 現在の待ち時間（0 = 失敗していない）
+  unsigned long delivered;        // 配信に成功した数
+  unsigned long failures;         // 接続失敗・タイムアウト・エラー応答の数
+  unsigned long dropped;          // キューが満杯で破棄した数
+  unsigned long latencyLastMs;    // キューに入れてから配信できるまでの時間
+  unsigned long latencyMaxMs;
+  unsigned long latencySumMs;
+};
+Subscriber subscribers[SUBSCRIBER_MAX];
+int subscriberNextStart = 0;      // 次に接続を始める通知先（順番に回す）
+
+// EEPROM の保存形式
+const int SUBSCRIBER_EEPROM_ADDR = 0;
+const uint32_t SUBSCRIBER_EEPROM_MAGIC = 0x3153444D; // "MDS1"
+struct SubscriberRecord {
+  uint8_t ip[4];
+  uint16_t port;
+  char path[SUBSCRIBER_PATH_MAX];
+};
+struct SubscriberStore {
+  uint32_t magic;
+  uint8_t count;
+  SubscriberRecord entries[SUBSCRIBER_MAX];
+};
+
+// --- ★ 複数ボードのクラスタ ---
+// 部屋ごとに担当ボードを決め、各ボードは自分の部屋の状態（区画のビットマスク）を
+// バージョン付きで UDP によりピアへ配る。受け取ったボードはより新しいバージョンだけを採用し、
+// GET / や /api/changes で全ボード分をまとめて返す。
+// 変化時の送信に加えて、一定間隔で知っている全部屋を送り直す（アンチエントロピー）ので、
+// パケットが失われたり、ボードが後から起動したりしても最終的に一致する。
+// 担当ボードから直接 CLUSTER_ROOM_TIMEOUT の間届かなかった部屋は、止まったとみなして消す。
+// ボードごとに CLUSTER_NODE_ID と固定IP（updateWifi() 内の local_ip）を変え、
+// clusterPeers には他の全ボードを並べること（部屋は担当ボードから直接受信して覚える）。
+bool clusterEnabled = false;             // 使用する場合は true
+const uint8_t CLUSTER_NODE_ID = 1;       // このボードの番号（1~255、ボードごとに異なる値）
+const int CLUSTER_PORT = 4210;
+IPAddress clusterPeers[] = {             // 他のボードのIPアドレス
+  IPAddress(172, 20, 10, 9),
+};
+const int CLUSTER_PEER_COUNT = sizeof(clusterPeers) / sizeof(clusterPeers[0]);
+const unsigned long CLUSTER_SYNC_INTERVAL = 2000; // 全状態の再送間隔
+const unsigned long CLUSTER_ROOM_TIMEOUT = 10000; // 担当ボードから届かなくなった部屋を消すまでの時間
+
+// このボードが担当する部屋（ボタンが配線されている部屋）
+const int LOCAL_ROOMS[] = {301, 302};
+const int LOCAL_ROOM_COUNT = sizeof(LOCAL_ROOMS) / sizeof(LOCAL_ROOMS[0]);
+uint32_t clusterLocalVersion[LOCAL_ROOM_COUNT] = {0, 0}; // 担当する部屋のバージョン
+
+// パケット形式と取り込み処理は cluster_proto.h（ネイティブテストと共通）
+ClusterNode cluster = {CLUSTER_NODE_ID, LOCAL_ROOMS, LOCAL_ROOM_COUNT, clusterLocalVersion, {}, false};
+
+WiFiUDP clusterUdp;
+unsigned long clusterNextSync = 0;
+
+// --- ★ 状態のアナウンス（UDP ブロードキャスト / マルチキャスト） ---
+// 状態が変わるたびと一定間隔で、担当する部屋のビットマスクを UDP で配る
+// 表示器やブリッジが何台あっても送信は1パケットなので、GET / のポーリングを減らせる
+// 受信側の例は tools/state_listener.cpp
+bool announceEnabled = false;               // 使用する場合は true
+const int ANNOUNCE_PORT = 4211;
+IPAddress announceGroup(0, 0, 0, 0);        // マルチキャストで送る場合はグループを指定（例: 239.255.42.1）
+                                            // 0.0.0.0 ならサブネットのブロードキャストアドレスに送る
+const unsigned long ANNOUNCE_INTERVAL = 1000; // 変化がなくても送る間隔（ハートビート）
+WiFiUDP announceUdp;
+unsigned long announceSeq = 0;              // 最後に送った状態の番号（localChangeSeq）
+unsigned long announceNext = 0;             // 次のハートビートの時刻 (millis)
+unsigned long announceSent = 0;             // 送信したパケット数
+
+// パケット形式（リトルエンディアン）
+//   "MDA" + 形式バージョン(1) + ボード番号(1) + 状態番号(4) + 件数(1)
+//   + 件数 × [部屋番号(2) マスク(2, bit n-1 = 区画 n)]
+// 状態番号は担当する部屋の状態が変わるたびに増えるので、受信側は同じ番号なら読み飛ばせる
+const int ANNOUNCE_HEADER_SIZE = 10;
+const int ANNOUNCE_ENTRY_SIZE = 4;
+
+// --- ★ 変更履歴（ジャーナル） ---
+// 状態変化をシーケンス番号付きでリングバッファに記録する
+// GET /api/changes?since=N で N より後の差分だけを返せるようにするため
+struct JournalEntry {
+  unsigned long seq;   // シーケンス番号（1から連番）
+  unsigned long time;  // 記録時刻 (millis)
+  int room;            // 部屋番号 (301 / 302)
+  int box;             // 区画番号 (1-16、-1の場合は全解除)
+  bool set;            // true: "set", false: "clear"
+};
+const int JOURNAL_SIZE = 64;
+JournalEntry journal[JOURNAL_SIZE];
+unsigned long journalSeq = 0;  // 最後に記録したシーケンス番号
+int journalCount = 0;          // 記録されている件数（最大 JOURNAL_SIZE）
+// ジャーナルにはクラスタの他ボードの部屋の変化も入るため、担当する部屋の変化だけを数える
+// （LED マトリクスとアナウンスは担当する部屋しか扱わないので、他ボードの変化では更新しない）
+unsigned long localChangeSeq = 0;
+
+// シーケンス番号は再起動で 0 に戻るため、起動ごとに変わる番号（EEPROM に数えた起動回数）を
+// /api/changes の応答に "boot" として含める。クライアントが送った boot と違えば全状態を返す
+const int BOOT_EEPROM_ADDR = SUBSCRIBER_EEPROM_ADDR + sizeof(SubscriberStore);
+const uint32_t BOOT_EEPROM_MAGIC = 0x3142444D; // "MDB1"
+struct BootStore {
+  uint32_t magic;
+  uint32_t count;
+};
+uint32_t bootId = 0;
+
+// --- ★ 呼び出しの集計 ---
+// 区画ごとに呼び出し回数と「set されてから clear されるまでの時間」を集計する
+// 時間はヒストグラム（15秒から倍々の区切り）と合計・最大で持ち、メモリは固定
+// 部屋ごとの集計は GET /api/stats の応答時に区画の値を足し合わせて作る
+const int STATS_BUCKETS = 8;
+// 各区切りの上限（秒）。最後の区切りはそれ以上すべて
+const unsigned long STATS_BUCKET_LIMITS[STATS_BUCKETS - 1] = {15, 30, 60, 120, 240, 480, 960};
+struct BoxStats {
+  unsigned long calls;        // set された回数
+  unsigned long cleared;      // clear された回数（= 応答時間の件数）
+  unsigned long sumSec;       // 応答時間の合計（秒）
+  unsigned long maxSec;       // 応答時間の最大（秒）
+  unsigned long openSince;    // set された時刻 (millis)
+  bool open;                  // set されたまま clear されていないか
+  uint16_t hist[STATS_BUCKETS]; // 応答時間のヒストグラム
+};
+BoxStats boxStats[LOCAL_ROOM_COUNT][16];  // [部屋 (LOCAL_ROOMS の順)][区画番号 - 1]
+
+// --- ★ 重複コマンドの抑止 ---
+// POST に任意で付けられる識別子で、再送されたコマンドを検出する
+//   {"clientId": "nuxt-1", "seq": 12, ...} : クライアントごとに seq が単調増加する前提
+//                                            最後に反映した seq 以下は再送/古いものとして無視
+//   {"key": "..."} または Idempotency-Key ヘッダー : 最近反映したキーと一致したら無視
+// 記録するのは applyCommand() が受け付けたコマンドだけ（不正なコマンドの seq・キーで
+// 後から届く正しいコマンドを捨てないため）
+// 次の場合は seq を覚えていないものとして扱う（クライアントの再起動で seq が戻っても詰まらないように）
+//   ・最後に反映してから DEDUPE_TTL 以上経った
+//   ・seq が最後に反映した値より DEDUPE_RESTART_GAP 以上小さい（再送でそこまで戻ることはない）
+struct DedupeClient {
+  uint32_t clientHash;    // clientId のハッシュ（0 = 未使用）
+  long lastSeq;           // 最後に反映した seq
+  unsigned long lastUsed; // 最後に使われた時刻（満杯時に最も古いものを入れ替える）
+};
+const int DEDUPE_CLIENTS = 8;
+const unsigned long DEDUPE_TTL = 600000UL; // seq を覚えておく時間 (ms)
+const long DEDUPE_RESTART_GAP = 64;        // これ以上 seq が戻ったらクライアントの再起動とみなす
+DedupeClient dedupeClients[DEDUPE_CLIENTS];
+
+// POST から取り出した識別子（isDuplicateCommand() で作り、受け付けたら recordCommand() で記録する）
+struct CommandId {
+  uint32_t clientHash;    // clientId のハッシュ（0 = なし）
+  long seq;
+  uint32_t keyHash;       // 冪等キーのハッシュ（0 = なし）
+};
+
+const int DEDUPE_KEYS = 16;
+uint32_t dedupeKeys[DEDUPE_KEYS];  // 最近のキーのハッシュ（リングバッファ、0 = 未使用）
+int dedupeKeyNext = 0;
+unsigned long duplicateCount = 0;  // 抑止した重複コマンド数
+
+// --- ★ HTTP 接続の受信状態 ---
+// 受信はブロックせず、スケジューラから呼ばれるたびに読める分だけ進める
+// 同時に受け付ける接続は HTTP_MAX_CONNS 件まで（超えた分は即座に 503 を返す）
+// 受信内容は固定長のバッファに入れる（String を使うとヒープが断片化するため）
+const int HTTP_LINE_MAX = 96;   // リクエストライン・ヘッダー行の最大長（超えた分は切り捨て）
+const int HTTP_BODY_MAX = 256;  // ボディの最大長（超えた分は切り捨て）
+const int HTTP_KEY_MAX = 48;    // Idempotency-Key・X-Admin-Token の最大長
+struct HttpConn {
+  WiFiClient client;
+  bool active;              // 受信中の接続か
+  unsigned long start;      // 接続を受け付けた時刻 (millis)
+  char requestLine[HTTP_LINE_MAX];
+  char currentLine[HTTP_LINE_MAX];
+  int currentLen;           // 現在の行の長さ（切り捨てた分も数える）
+  char body[HTTP_BODY_MAX];
+  int bodyLen;              // ボディの長さ（切り捨てた分も数える）
+  char idempotencyKey[HTTP_KEY_MAX];
+  char adminToken[HTTP_KEY_MAX];  // X-Admin-Token ヘッダーの値
+  bool isFirstLine;
+  bool headerEnded;
+  long contentLength;       // Content-Length（-1 = ヘッダーなし）
+  bool isPriority;          // POST と OPTIONS（ブラウザが POST の前に送る）は GET より優先する
+};
+const int HTTP_MAX_CONNS = 3;
+HttpConn httpConns[HTTP_MAX_CONNS];
+const int HTTP_READ_CHUNK = 128;          // 1回の呼び出しで1接続から読む最大バイト数
+const unsigned long HTTP_TIMEOUT = 5000;  // リクエストを受信し終えるまでの待ち時間
+const unsigned long HTTP_HEADER_TIMEOUT = 1000; // ヘッダーを受信し終えるまでの待ち時間（少しずつ送って接続を占有されないように短くする）
+
+// --- ★ アクセス制限（送信元IPごとのトークンバケット） ---
+// トークンは毎秒 RATE_REFILL_PER_SEC 個ずつ RATE_BUCKET_SIZE 個まで貯まり、
+// リクエストごとに POST（と OPTIONS）は1個、GET は2個を使う。足りなければ 429 を返す
+// トンネル経由の通信はすべて cloudflared のIPから届くため、GET は残りを
+// RATE_POST_RESERVE 個より減らせない（GET が続いても POST の分は残る）
+// 接続を受け付ける時点でもトークンが残っているかを確認し、リクエストラインを送り始めたまま
+// タイムアウトした接続には RATE_COST_STALL 個を課す（同じIPからの占有を止めるため）
+// 1つのIPを多数の利用者が共有する相手（cloudflared を動かしている PC、CC:Tweaked の
+// Minecraft サーバーなど）は rateExemptIps に加えると制限しない（同時接続数の上限は残る）
+// 以下の値は必要に応じて変更してください
+const float RATE_BUCKET_SIZE = 10.0;   // 貯められるトークン数（連続して受け付けられる数）
+const float RATE_REFILL_PER_SEC = 2.0; // 1秒あたりに補充するトークン数
+const int RATE_COST_POST = 1;
+const int RATE_COST_GET = 2;
+const int RATE_COST_STALL = 3;
+const int RATE_POST_RESERVE = 4;
+IPAddress rateExemptIps[] = {          // 制限しない送信元（例: IPAddress(192, 168, 1, 10)）
+  IPAddress(127, 0, 0, 1),
+};
+const int RATE_EXEMPT_COUNT = sizeof(rateExemptIps) / sizeof(rateExemptIps[0]);
+
+struct RateBucket {
+  uint32_t ip;              // 送信元IP（0 = 未使用）
+  float tokens;
+  unsigned long lastRefill; // 最後にトークンを補充した時刻 (millis)
+};
+const int RATE_BUCKETS = 8;
+RateBucket rateBuckets[RATE_BUCKETS];
+
+unsigned long rejectedBusy = 0;        // 同時接続数の上限で断った数 (503)
+unsigned long rejectedStalled = 0;     // ヘッダーを途中まで送ったままタイムアウトした数 (408)
+unsigned long rejectedRateLimit = 0;   // トークン不足で断った数 (429)
+
+// --- ★ 協調型タスクスケジューラ ---
+// loop() は runScheduler() を呼ぶだけにし、各処理を周期タスクとして実行する
+// 実行時間が予算（budgetUs）を超えた回数を記録し、/api/metrics で確認できる
+struct Task {
+  const char* name;
+  void (*run)();
+  bool (*ready)();          // I/O 待ちのタスク用: true なら周期に関係なく実行（不要なら nullptr）
+  unsigned long periodMs;   // 実行周期
+  unsigned long budgetUs;   // 1回の実行時間の予算
+  unsigned long nextRun;    // 次の実行時刻 (millis)
+  unsigned long runs;       // 実行回数
+  unsigned long overruns;   // 予算超過回数
+  unsigned long maxUs;      // 最大実行時間
+  unsigned long totalUs;    // 合計実行時間
+};
+
+void taskButtons();
+void taskWifi();
+void taskHttp();
+bool httpReady();
+void taskWebSocket();
+void taskNotify();
+void taskLog();
+void taskCluster();
+void taskMatrix();
+void taskAnnounce();
+
+// 先頭のタスクほど優先度が高い（同じ周回で先に実行される）
+Task tasks[] = {
+  // name        run            ready      period  budget
+  {"buttons",   taskButtons,   nullptr,     5,     500,   0, 0, 0, 0, 0},
+  {"wifi",      taskWifi,      nullptr,    50,   20000,   0, 0, 0, 0, 0},
+  {"http",      taskHttp,      httpReady,  10,   50000,   0, 0, 0, 0, 0},
+  {"websocket", taskWebSocket, nullptr,    20,   10000,   0, 0, 0, 0, 0},
+  {"notify",    taskNotify,    nullptr,    20,   50000,   0, 0, 0, 0, 0},
+  {"log",       taskLog,       nullptr,    10,    2000,   0, 0, 0, 0, 0},
+  {"cluster",   taskCluster,   nullptr,    20,   10000,   0, 0, 0, 0, 0},
+  {"matrix",    taskMatrix,    nullptr,   100,    1000,   0, 0, 0, 0, 0},
+  {"announce",  taskAnnounce,  nullptr,    50,    5000,   0, 0, 0, 0, 0},
+};
+const int TASK_COUNT = sizeof(tasks) / sizeof(tasks[0]);
+const int TASK_BUTTONS = 0;
+
+unsigned long scanGapMaxUs = 0;   // ボタンスキャンの間隔の最大値（= 最悪のボタン応答遅延）
+unsigned long lastScanUs = 0;     // 前回ボタンスキャンを開始した時刻 (micros)
+unsigned long sleepCount = 0;     // WFI でスリープした回数
+
+// --- ★ シリアルログのバッファ ---
+// Serial（9600bps）への出力は遅く、そのまま書くと処理が止まるため
+// いったんリングバッファに貯め、log タスクが少しずつ送り出す
+class LogBuffer : public Print {
+public:
+  using Print::write;
+  size_t write(uint8_t c) override {
+    if (count == sizeof(buf)) {
+      dropped++;
+      return 0;
+    }
+    buf[(head + count) % sizeof(buf)] = c;
+    count++;
+    return 1;
+  }
+
+  // 最大 maxBytes バイトを Serial に送る
+  void drain(int maxBytes) {
+    while (count > 0 && maxBytes-- > 0) {
+      Serial.write(buf[head]);
+      head = (head + 1) % sizeof(buf);
+      count--;
+    }
+  }
+
+  unsigned long dropped = 0;  // バッファ満杯で捨てたバイト数
+
+private:
+  uint8_t buf[1024];
+  size_t head = 0;
+  size_t count = 0;
+};
+LogBuffer Log;
+const int LOG_DRAIN_BYTES = 8;  // 10ms ごとに 8 バイト（9600bps の送信能力以下）
+
+// --- ★ バッファ付き出力 ---
+// WiFiClient への print は1回ごとに WiFi モジュールとの通信が発生するため、
+// 256 バイトずつまとめて送る。送るたびにボタンのスキャンを挟む。
+void schedulerYield();
+class BufferedWriter : public Print {
+public:
+  explicit BufferedWriter(WiFiClient &c) : client(c) {}
+
+  size_t write(uint8_t c) override {
+    if (len == sizeof(buf)) flush();
+    buf[len++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t written = size;
+    while (size > 0) {
+      if (len == sizeof(buf)) flush();
+      size_t n = sizeof(buf) - len;
+      if (n > size) n = size;
+      memcpy(buf + len, data, n);
+      len += n;
+      data += n;
+      size -= n;
+    }
+    return written;
+  }
+
+  void flush() override {
+    if (len > 0) {
+      client.write(buf, len);
+      len = 0;
+      schedulerYield();
+    }
+  }
+
+private:
+  WiFiClient &client;
+  uint8_t buf[256];
+  size_t len = 0;
+};
+
+// --- ★ LED マトリクス（12×8）の状態表示 ---
+// 左から 301 の区画（4×4）、302 の区画（4×4）、右端の列にリンクと通知キューの状態を表示する
+//   列 0-3 / 行 2-5: 部屋301 の区画 1-16（左上から行ごと）
+//   列 5-8 / 行 2-5: 部屋302 の区画 1-16
+//   列 11 / 行 0:    WiFi 接続中なら点灯
+//   列 11 / 行 4-7:  通知キューの溜まり具合（最も溜まっているキュー、下から最大4個）
+// ボタンスキャンからは描画せず、matrix タスクが変化のあった時だけ描き直す
+const int MATRIX_ROWS = 8;
+const int MATRIX_COLS = 12;
+const int MATRIX_ROOM_TOP = 2;        // 区画表示の先頭行
+const int MATRIX_ROOM301_LEFT = 0;    // 部屋301 の先頭列
+const int MATRIX_ROOM302_LEFT = 5;    // 部屋302 の先頭列
+const int MATRIX_STATUS_COL = 11;     // リンク・キュー表示の列
+const int MATRIX_QUEUE_LEVELS = 4;    // キュー表示の段数
+ArduinoLEDMatrix matrix;
+uint8_t matrixFrame[MATRIX_ROWS][MATRIX_COLS];
+bool matrixDrawn = false;             // 1回でも描画したか
+unsigned long matrixShownSeq = 0;     // 表示中の状態の番号（localChangeSeq）
+bool matrixShownLink = false;         // 表示中のリンク状態
+int matrixShownQueue = 0;             // 表示中のキューの段数
+unsigned long matrixRedraws = 0;      // 描き直した回数
+
+// --- ★ 起動時間の計測 ---
+unsigned long bootToFirstScan = 0;   // 起動から最初のボタンスキャンまで (ms)
+unsigned long bootToFirstServe = 0;  // 起動から最初のリクエスト応答まで (ms)
+bool firstScanDone = false;
+bool firstServeDone = false;
+
+// --- ★ メモリの計測 ---
+// RAM は 32KB しかなく、ヒープとスタックが衝突すると黙って壊れるため
+// 空きヒープ・スタックの最大使用量を /api/metrics で見られるようにする
+// （リンカスクリプトのシンボル。無い環境では 0 になり計測を省略する）
+extern "C" char __HeapLimit __attribute__((weak));
+extern "C" char __StackLimit __attribute__((weak));
+extern "C" char __StackTop __attribute__((weak));
+extern "C" void* _sbrk(ptrdiff_t incr);
+
+const uint8_t STACK_PAINT = 0xA5;     // 未使用のスタックを塗りつぶす値
+const size_t STACK_PAINT_MARGIN = 256; // setup() 実行中のスタックは塗らずに残す
+size_t heapFreeMin = (size_t)-1;       // 空きヒープの最小値（リクエスト処理後に更新）
+
+#ifdef MEM_TRACE
+// -Wl,--wrap=malloc などでリンクしたときだけ、ヒープ確保の回数を数える
+// （platformio.ini の uno_r4_wifi_memtrace 環境を参照）
+unsigned long allocCount = 0;       // malloc/realloc/calloc の呼び出し回数
+unsigned long allocBytes = 0;       // 確保を要求したバイト数の合計
+unsigned long freeCount = 0;        // free の呼び出し回数
+unsigned long requestAllocsLast = 0; // 直前のリクエスト処理中の確保回数
+unsigned long requestAllocsMax = 0;  // リクエスト処理中の確保回数の最大値
+
+extern "C" {
+void* __real_malloc(size_t size);
+void __real_free(void* ptr);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_calloc(size_t n, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  allocCount++;
+  allocBytes += size;
+  return __real_malloc(size);
+}
+void __wrap_free(void* ptr) {
+  if (ptr != nullptr) freeCount++;
+  __real_free(ptr);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+  allocCount++;
+  allocBytes += size;
+  return __real_realloc(ptr, size);
+}
+void* __wrap_calloc(size_t n, size_t size) {
+  allocCount++;
+  allocBytes += n * size;
+  return __real_calloc(n, size);
+}
+}
+#endif
+
 // --- 関数プロトタイプ ---
 void printWifiStatus();
 void sendDynamicPage(WiFiClient client);
-void sendToCCTweaked(String room, int box, String action);
+void renderRoom(Print &out, int room, const RoomLayout &layout, uint16_t mask);
+void pollSubscribers();
+int addSubscriber(const IPAddress &ip, uint16_t port, const char* path, bool persistent, bool wsReplaces);
+void loadSubscribers();
+void initBootId();
+void sendSubscribers(WiFiClient &client);
+bool adminAuthorized(WiFiClient &client, const char* token);
+void handleSubscriberPost(WiFiClient &client, const char* body);
+void handleSubscriberDelete(WiFiClient &client, const char* path);
+int notifyQueueLevel(int levels);
+int notifyPendingCount();
 bool isCCTweakedConfigured();
+void scanButtons(unsigned long currentTime);
+void updateWifi(unsigned long currentTime);
+void markLinkDown(unsigned long currentTime);
+void handleClient();
+bool admitRequest(HttpConn &conn);
+void serveRequest(WiFiClient &client, char* requestLine, const char* body, const char* idempotencyKey,
+                  const char* adminToken);
+void sendMetrics(WiFiClient &client);
+void runScheduler();
+void schedulerYield();
+void queueNotify(const char* room, int box, const char* action);
+void recordChange(const char* room, int box, const char* action);
+void journalAppend(int room, int box, bool set);
+uint16_t localRoomMask(int room);
+bool clusterForwardCommand(const char* room, int box, const char* action);
+void pollCluster();
+bool applyCommand(const char* body);
+bool jsonField(const char* body, const char* name, char* out, size_t outSize);
+bool isDuplicateCommand(const char* body, const char* headerKey, CommandId &id);
+void recordCommand(const CommandId &id);
+void sendChanges(WiFiClient &client, const char* path);
+void statsRecord(int room, int box, bool set);
+void sendStats(WiFiClient &client);
+void drainNotifyQueue();
+void pollWebSocket();
+int wsOpenCount();
+bool wsBroadcastEvent(const char* room, int box, bool set);
+void updateMatrix();
+void pollAnnounce();
+void paintStack();
+size_t stackUsed();
+size_t heapFree();
+size_t heapLargestFree();
 
 void setup() {
+  // 未使用のスタックを塗っておき、後で最大使用量を調べられるようにする
+  paintStack();
+
   Serial.begin(9600);
   pinMode(led, OUTPUT);
 
@@ -152,46 +786,156 @@ void setup() {
   pinMode(BTN3_PIN, INPUT);
   pinMode(BTN4_PIN, INPUT);
 
-  if (WiFi.status() == WL_NO_MODULE) {
-    Serial.println("Communication with WiFi module failed!");
-    while (true);
+  // LED マトリクスの表示は matrix タスクで更新する
+  matrix.begin();
+
+  // WiFi への接続は loop() 内の updateWifi() で進める（ここでは待たない）
+  wifiState = WIFI_STATE_CHECK_MODULE;
+  wifiNextActionTime = millis();
+
+  // --- cc:tweaked サーバーのIPアドレスを設定（必要に応じて変更してください）---
+  // 例: cctweaked_ip = IPAddress(192, 168, 1, 100);
+  // コメントアウトしている場合は、cc:tweakedへの送信は行われません
+  // （通知先は実行中に /api/subscribers で登録することもできる）
+  // cctweaked_ip = IPAddress(192, 168, 1, 100);
+
+  // 起動回数を数えて、/api/changes で再起動を見分けられるようにする
+  initBootId();
+
+  // 保存されている通知先を読み込み、cctweaked_ip も通知先として加える
+  loadSubscribers();
+  if (isCCTweakedConfigured()) {
+    int id = addSubscriber(cctweaked_ip, cctweaked_port, "/api/box", false, true);
+    if (id != -1) {
+      // EEPROM に同じ宛先が保存されていた場合もその登録が返るので、WebSocket との二重送信を止める
+      subscribers[id].wsReplaces = true;
+    }
   }
+}
 
-  String fv = WiFi.firmwareVersion();
-  if (fv < WIFI_FIRMWARE_LATEST_VERSION) {
-    Serial.println("Please upgrade the firmware");
+
+void loop() {
+  runScheduler();
+}
+
+// --- ★ スケジューラのタスク ---
+
+// ボタンのスキャンは WiFi の状態に関係なく行う
+void taskButtons() {
+  unsigned long nowUs = micros();
+  if (lastScanUs != 0 && nowUs - lastScanUs > scanGapMaxUs) {
+    scanGapMaxUs = nowUs - lastScanUs;
+  }
+  if (lastScanUs != 0 && wifiState != WIFI_STATE_CONNECTED &&
+      nowUs - lastScanUs > scanGapOfflineMaxUs) {
+    scanGapOfflineMaxUs = nowUs - lastScanUs;
   }
+  lastScanUs = nowUs;
+  scanButtons(millis());
+}
 
-    // 固定IPアドレスの設定
-    IPAddress local_ip(172, 20, 10, 8);
-    IPAddress gateway(172, 20, 10, 1);
-    IPAddress subnet(255, 255, 255, 0);
-    IPAddress dns(172, 20, 10, 1);
-    
-    // IPアドレスを固定する設定
-    WiFi.config(local_ip, gateway, subnet, dns);
+// WiFi 接続処理とリンク監視（ブロックしない）
+void taskWifi() {
+  updateWifi(millis());
+}
+
+// 受信途中の HTTP 接続があれば周期を待たずに続きを読む
+bool httpReady() {
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (httpConns[i].active) return true;
+  }
+  return false;
+}
 
-  while (status != WL_CONNECTED) {
-    Serial.print("Attempting to connect to Network named: ");
-    Serial.println(ssid);
+void taskHttp() {
+  if (wifiState == WIFI_STATE_CONNECTED) handleClient();
+}
+
+void taskWebSocket() {
+  if (wifiState == WIFI_STATE_CONNECTED && wsPushEnabled) pollWebSocket();
+}
 
-    status = WiFi.begin(ssid, pass);
-    delay(10000);
+void taskNotify() {
+  if (wifiState == WIFI_STATE_CONNECTED) {
+    drainNotifyQueue();
+    pollSubscribers();
   }
-  server.begin();
-  printWifiStatus();
+}
 
-  // --- cc:tweaked サーバーのIPアドレスを設定（必要に応じて変更してください）---
-  // 例: cctweaked_ip = IPAddress(192, 168, 1, 100);
-  // コメントアウトしている場合は、cc:tweakedへの送信は行われません
-  // cctweaked_ip = IPAddress(192, 168, 1, 100);
+void taskLog() {
+  Log.drain(LOG_DRAIN_BYTES);
 }
 
+void taskCluster() {
+  if (wifiState == WIFI_STATE_CONNECTED && clusterEnabled) pollCluster();
+}
 
-void loop() {
-  // --- トグルスイッチの状態をチェック（押した瞬間にtrue、releaseリクエストまで維持） ---
-  unsigned long currentTime = millis();
-  
+void taskMatrix() {
+  updateMatrix();
+}
+
+void taskAnnounce() {
+  if (wifiState == WIFI_STATE_CONNECTED && announceEnabled) pollAnnounce();
+}
+
+/**
+ * @brief タスクを1つ実行して実行時間を記録する
+ */
+void runTask(Task &t) {
+  unsigned long start = micros();
+  t.run();
+  unsigned long elapsed = micros() - start;
+
+  t.runs++;
+  t.totalUs += elapsed;
+  if (elapsed > t.maxUs) t.maxUs = elapsed;
+  if (elapsed > t.budgetUs) t.overruns++;
+}
+
+/**
+ * @brief 実行時刻になったタスクを優先度順に実行する。実行するものがなければ WFI で待つ
+ */
+void runScheduler() {
+  unsigned long now = millis();
+  bool ranAny = false;
+
+  for (int i = 0; i < TASK_COUNT; i++) {
+    Task &t = tasks[i];
+    bool due = (long)(now - t.nextRun) >= 0;
+    bool ready = t.ready != nullptr && t.ready();
+    if (!due && !ready) continue;
+
+    runTask(t);
+    if (due) t.nextRun = now + t.periodMs;
+    ranAny = true;
+  }
+
+  if (!ranAny) {
+    // 次の割り込み（1ms のシステムタイマー、または WiFi モジュールの UART）まで眠る
+    sleepCount++;
+    __WFI();
+  }
+}
+
+/**
+ * @brief 時間のかかる処理の途中から呼び、ボタンのスキャンだけは周期通りに実行する
+ *
+ * ページ送信や cc:tweaked の応答待ちの間もボタンの応答遅延を抑えるため。
+ */
+void schedulerYield() {
+  Task &t = tasks[TASK_BUTTONS];
+  unsigned long now = millis();
+  if ((long)(now - t.nextRun) >= 0) {
+    runTask(t);
+    t.nextRun = now + t.periodMs;
+  }
+}
+
+/**
+ * @brief タクトスイッチの状態をチェック（押した瞬間にtrue、releaseリクエストまで維持）
+ * @param currentTime 現在時刻 (millis)
+ */
+void scanButtons(unsigned long currentTime) {
   // 2-301室のタクトスイッチを処理（新しい区画番号→ピン番号のマッピングを使用）
   // プルダウン接続: 押していない時=LOW、押している時=HIGH
   for (int newBox = 1; newBox <= 16; newBox++) {
@@ -223,18 +967,16 @@ void loop() {
         // 押された瞬間（LOW→HIGH）のみtrueに設定（離してもtrueのまま）
         if (stableBtn301[pinIdx] == LOW && currentBtn == HIGH) {
           box301State[oldIdx] = true; // 新しい区画番号に対応する古いインデックスの状態を更新
-          Serial.print("BTN301[新区画");
-          Serial.print(newBox);
-          Serial.print("] (pin ");
-          Serial.print(pin);
-          Serial.print(") pressed -> box301State[");
-          Serial.print(oldIdx);
-          Serial.println("] = true");
+          Log.print("BTN301[新区画");
+          Log.print(newBox);
+          Log.print("] (pin ");
+          Log.print(pin);
+          Log.print(") pressed -> box301State[");
+          Log.print(oldIdx);
+          Log.println("] = true");
           
-          // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-          if (isCCTweakedConfigured()) {
-            sendToCCTweaked("301", newBox, "set");
-          }
+          // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+          recordChange("301", newBox, "set");
         }
         // 離したとき（HIGH→LOW）は状態を変更しない（releaseリクエストまで維持）
         stableBtn301[pinIdx] = currentBtn;
@@ -257,16 +999,14 @@ void loop() {
         int oldIdx = ROOM302_NEW_TO_OLD[newBox]; // 古いインデックス2
         if (oldIdx != -1) {
           box302State[oldIdx] = true;
-          Serial.print("BTN3 pressed -> box302State[新区画");
-          Serial.print(newBox);
-          Serial.print(" -> 古いインデックス");
-          Serial.print(oldIdx);
-          Serial.println("] = true");
+          Log.print("BTN3 pressed -> box302State[新区画");
+          Log.print(newBox);
+          Log.print(" -> 古いインデックス");
+          Log.print(oldIdx);
+          Log.println("] = true");
           
-          // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-          if (isCCTweakedConfigured()) {
-            sendToCCTweaked("302", newBox, "set");
-          }
+          // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+          recordChange("302", newBox, "set");
         }
       }
       // 離したとき（HIGH→LOW）は状態を変更しない（releaseリクエストまで維持）
@@ -289,16 +1029,14 @@ void loop() {
         int oldIdx = ROOM302_NEW_TO_OLD[newBox]; // 古いインデックス7
         if (oldIdx != -1) {
           box302State[oldIdx] = true;
-          Serial.print("BTN4 pressed -> box302State[新区画");
-          Serial.print(newBox);
-          Serial.print(" -> 古いインデックス");
-          Serial.print(oldIdx);
-          Serial.println("] = true");
+          Log.print("BTN4 pressed -> box302State[新区画");
+          Log.print(newBox);
+          Log.print(" -> 古いインデックス");
+          Log.print(oldIdx);
+          Log.println("] = true");
           
-          // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-          if (isCCTweakedConfigured()) {
-            sendToCCTweaked("302", newBox, "set");
-          }
+          // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+          recordChange("302", newBox, "set");
         }
       }
       // 離したとき（HIGH→LOW）は状態を変更しない（releaseリクエストまで維持）
@@ -307,554 +1045,2495 @@ void loop() {
   }
   prevBtn4 = currentBtn4;
 
-  WiFiClient client = server.available();
+  if (!firstScanDone) {
+    firstScanDone = true;
+    bootToFirstScan = millis();
+    Log.print("Boot to first button scan: ");
+    Log.print(bootToFirstScan);
+    Log.println(" ms");
+  }
+}
 
-  if (client) {
-    Serial.println("new client");
-    
-    // --- シンプルな HTTP パーサ ---
-    String requestLine = "";
-    String currentLine = "";
-    String body = "";
-    bool isFirstLine = true;
-    bool headerEnded = false;
-
-    // タイムアウト対策
-    unsigned long startTime = millis();
-
-    while (client.connected() && (millis() - startTime) < 5000) {
-      if (client.available()) {
-        char c = client.read();
-
-        if (!headerEnded) {
-          // ヘッダー行の処理（\n 区切り）
-          if (c == '\n') {
-            // 1行終わり
-            if (currentLine.length() == 0) {
-              // 空行 = ヘッダー終わり
-              headerEnded = true;
-            } else {
-              if (isFirstLine) {
-                requestLine = currentLine;
-                isFirstLine = false;
-              }
-              currentLine = "";
-            }
-          } else if (c != '\r') {
-            currentLine += c;
-          }
-        } else {
-          // ヘッダー終わり以降はボディとして全部読み込む
-          body += c;
-        }
-      } else {
-        // これ以上届くデータがなさそうなら抜ける
-        if (headerEnded) break;
+/**
+ * @brief WiFi 接続ステートマシンを1ステップ進める（loop() から毎回呼ぶ）
+ * @param currentTime 現在時刻 (millis)
+ *
+ * 接続に失敗した場合は 500ms から始めて 8秒まで倍々に間隔を伸ばして再試行する。
+ * WiFi.begin() は接続要求を送るだけで戻り（WIFI_BEGIN_TIMEOUT）、完了は
+ * WIFI_STATE_JOINING で status() を確認して待つので、1回の呼び出しは
+ * WiFi モジュールとの AT コマンド1往復程度で終わり、ボタンのスキャンは止まらない。
+ * 接続していない間のスキャン間隔の最大値は /api/metrics の link.scanGapOfflineMaxUs で確認できる。
+ */
+void updateWifi(unsigned long currentTime) {
+  if ((long)(currentTime - wifiNextActionTime) < 0) {
+    return; // まだ次の処理の時刻ではない
+  }
+
+  switch (wifiState) {
+    case WIFI_STATE_CHECK_MODULE: {
+      if (WiFi.status() == WL_NO_MODULE) {
+        // モジュールが見つからなくても停止せず、ボタン処理を続けながら再確認する
+        Log.println("Communication with WiFi module failed!");
+        wifiNextActionTime = currentTime + WIFI_MODULE_RETRY;
+        return;
+      }
+
+      String fv = WiFi.firmwareVersion();
+      if (fv < WIFI_FIRMWARE_LATEST_VERSION) {
+        Log.println("Please upgrade the firmware");
       }
+
+      // 固定IPアドレスの設定
+      IPAddress local_ip(172, 20, 10, 8);
+      IPAddress gateway(172, 20, 10, 1);
+      IPAddress subnet(255, 255, 255, 0);
+      IPAddress dns(172, 20, 10, 1);
+
+      // IPアドレスを固定する設定
+      WiFi.config(local_ip, gateway, subnet, dns);
+
+      wifiState = WIFI_STATE_CONNECTING;
+      wifiBackoff = WIFI_BACKOFF_MIN;
+      wifiNextActionTime = currentTime;
+      break;
     }
 
-    requestLine.trim();
-    Serial.print("Request Line: ");
-    Serial.println(requestLine);
-
-    // --- メソッド判定 ---
-    bool isPost    = requestLine.startsWith("POST ");
-    bool isGet     = requestLine.startsWith("GET ");
-    bool isOptions = requestLine.startsWith("OPTIONS ");
-
-    if (isOptions) {
-      // --- CORS プリフライト用のレスポンス ---
-      client.println("HTTP/1.1 204 No Content");
-      client.println("Access-Control-Allow-Origin: *");
-      client.println("Access-Control-Allow-Methods: GET, POST, OPTIONS");
-      client.println("Access-Control-Allow-Headers: Content-Type");
-      client.println("Connection: close");
-      client.println();
-    } else if (isPost) {
-      // Cloudflare Tunnel 経由で Nuxt から来る JSON を想定
-      Serial.print("POST body: ");
-      Serial.println(body);
-
-      // JSON パース: {"room": "203", "box": 3, "action": "set"} または {"productNumber": 3} (後方互換)
-      
-      // 後方互換性: productNumber の処理（部屋302として処理）
-      int idxProduct = body.indexOf("\"productNumber\"");
-      if (idxProduct != -1) {
-        int idxColon = body.indexOf(":", idxProduct);
-        if (idxColon != -1) {
-          int idxEnd = body.indexOf("}", idxColon);
-          if (idxEnd == -1) idxEnd = body.length();
-          String numStr = body.substring(idxColon + 1, idxEnd);
-          numStr.trim();
-          int num = numStr.toInt();
-
-          if (num >= 1 && num <= 16) {
-            // 新しい区画番号を古いインデックスに変換
-            int oldIdx = ROOM302_NEW_TO_OLD[num];
-            if (oldIdx != -1) {
-              box302State[oldIdx] = true;
-              Serial.print("productNumber: box302State[新区画");
-              Serial.print(num);
-              Serial.print(" -> 古いインデックス");
-              Serial.print(oldIdx);
-              Serial.println("] = true");
-              
-              // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-              if (isCCTweakedConfigured()) {
-                sendToCCTweaked("302", num, "set");
-              }
-            }
-          }
-        }
+    case WIFI_STATE_CONNECTING: {
+      // 前回の試行がバックグラウンドで完了していないか先に確認する
+      status = WiFi.status();
+      if (status != WL_CONNECTED) {
+        Log.print("Attempting to connect to Network named: ");
+        Log.println(ssid);
+        WiFi.setTimeout(WIFI_BEGIN_TIMEOUT);
+        WiFi.begin(ssid, pass); // 接続要求を送るだけで、完了は待たない
+        wifiState = WIFI_STATE_JOINING;
+        wifiJoinStart = millis();
+        wifiNextActionTime = wifiJoinStart + WIFI_JOIN_POLL;
+        return;
       }
+      wifiState = WIFI_STATE_JOINING;
+      // すでに接続できていれば接続後の処理へ進む
+      [[fallthrough]];
+    }
 
-      // 新しい形式: {"room": "302", "box": 3, "action": "set"} または {"room": "302", "action": "clear"}
-      int idxRoom = body.indexOf("\"room\"");
-      if (idxRoom != -1) {
-        // room の値を取得
-        int idxColon = body.indexOf(":", idxRoom);
-        int idxComma = body.indexOf(",", idxColon);
-        int idxEnd = body.indexOf("}", idxColon);
-        if (idxComma != -1 && idxComma < idxEnd) idxEnd = idxComma;
-        String roomStr = body.substring(idxColon + 1, idxEnd);
-        roomStr.trim();
-        roomStr.replace("\"", "");
-        
-        // box の値を取得（オプション）
-        int idxBox = body.indexOf("\"box\"");
-        int boxNum = -1;
-        if (idxBox != -1) {
-          int idxBoxColon = body.indexOf(":", idxBox);
-          int idxBoxComma = body.indexOf(",", idxBoxColon);
-          int idxBoxEnd = body.indexOf("}", idxBoxColon);
-          if (idxBoxComma != -1 && idxBoxComma < idxBoxEnd) idxBoxEnd = idxBoxComma;
-          String boxStr = body.substring(idxBoxColon + 1, idxBoxEnd);
-          boxStr.trim();
-          boxNum = boxStr.toInt();
+    case WIFI_STATE_JOINING: {
+      status = WiFi.status();
+      if (status == WL_CONNECTED) {
+        // 再接続時もサーバーを起動し直す
+        server.begin();
+        if (wsPushEnabled) wsServer.begin();
+        if (clusterEnabled) {
+          clusterUdp.begin(CLUSTER_PORT);
+          clusterNextSync = millis(); // 接続直後に全状態を送る
         }
-
-        // action の値を取得
-        int idxAction = body.indexOf("\"action\"");
-        String actionStr = "";
-        if (idxAction != -1) {
-          int idxActionColon = body.indexOf(":", idxAction);
-          int idxActionComma = body.indexOf(",", idxActionColon);
-          int idxActionEnd = body.indexOf("}", idxActionColon);
-          if (idxActionComma != -1 && idxActionComma < idxActionEnd) idxActionEnd = idxActionComma;
-          actionStr = body.substring(idxActionColon + 1, idxActionEnd);
-          actionStr.trim();
-          actionStr.replace("\"", "");
+        if (announceEnabled) {
+          announceUdp.begin(ANNOUNCE_PORT);
+          announceNext = millis(); // 接続直後にアナウンスする
         }
+        printWifiStatus();
+        wifiState = WIFI_STATE_CONNECTED;
+        wifiBackoff = WIFI_BACKOFF_MIN;
+        wifiNextActionTime = millis() + LINK_CHECK_INTERVAL;
 
-        // 処理実行
-        if (roomStr == "302") {
-          if (actionStr == "clear") {
-            // 全解除
-            if (boxNum >= 1 && boxNum <= 16) {
-              // 新しい区画番号を古いインデックスに変換
-              int oldIdx = ROOM302_NEW_TO_OLD[boxNum];
-              if (oldIdx != -1) {
-                box302State[oldIdx] = false;
-                Serial.print("Clear box302State[新区画");
-                Serial.print(boxNum);
-                Serial.print(" -> 古いインデックス");
-                Serial.print(oldIdx);
-                Serial.println("] = false");
-                
-                // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-                if (isCCTweakedConfigured()) {
-                  sendToCCTweaked("302", boxNum, "clear");
-                }
-              }
-            } else {
-              // box が指定されていない場合は全解除
-              for (int i = 0; i < 16; i++) {
-                box302State[i] = false;
-              }
-              Serial.println("Clear all box302State = false");
-              
-              // 全解除の場合は、cc:tweakedに通知（box=nullで送信）
-              if (isCCTweakedConfigured()) {
-                sendToCCTweaked("302", -1, "clear"); // box=-1は全解除を示す
-              }
-            }
-          } else if (actionStr == "set" && boxNum >= 1 && boxNum <= 16) {
-            // 新しい区画番号を古いインデックスに変換
-            int oldIdx = ROOM302_NEW_TO_OLD[boxNum];
-            if (oldIdx != -1) {
-              box302State[oldIdx] = true;
-              Serial.print("Set box302State[新区画");
-              Serial.print(boxNum);
-              Serial.print(" -> 古いインデックス");
-              Serial.print(oldIdx);
-              Serial.println("] = true");
-              
-              // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-              if (isCCTweakedConfigured()) {
-                sendToCCTweaked("302", boxNum, "set");
-              }
-            }
-          }
-        } else if (roomStr == "301") {
-          if (actionStr == "clear") {
-            // 全解除
-            if (boxNum >= 1 && boxNum <= 16) {
-              // 新しい区画番号を古いインデックスに変換
-              int oldIdx = ROOM301_NEW_TO_OLD[boxNum];
-              if (oldIdx != -1) {
-                box301State[oldIdx] = false;
-                Serial.print("Clear box301State[新区画");
-                Serial.print(boxNum);
-                Serial.print(" -> 古いインデックス");
-                Serial.print(oldIdx);
-                Serial.println("] = false");
-                
-                // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-                if (isCCTweakedConfigured()) {
-                  sendToCCTweaked("301", boxNum, "clear");
-                }
-              }
-            } else {
-              // box が指定されていない場合は全解除
-              for (int i = 0; i < 16; i++) {
-                box301State[i] = false;
-              }
-              Serial.println("Clear all box301State = false");
-              
-              // 全解除の場合は、cc:tweakedに通知（box=nullで送信）
-              if (isCCTweakedConfigured()) {
-                sendToCCTweaked("301", -1, "clear"); // box=-1は全解除を示す
-              }
-            }
-          } else if (actionStr == "set" && boxNum >= 1 && boxNum <= 16) {
-            // 新しい区画番号を古いインデックスに変換
-            int oldIdx = ROOM301_NEW_TO_OLD[boxNum];
-            if (oldIdx != -1) {
-              box301State[oldIdx] = true;
-              Serial.print("Set box301State[新区画");
-              Serial.print(boxNum);
-              Serial.print(" -> 古いインデックス");
-              Serial.print(oldIdx);
-              Serial.println("] = true");
-              
-              // 状態が変化したので、cc:tweakedに通知（新しい区画番号を使用）
-              if (isCCTweakedConfigured()) {
-                sendToCCTweaked("301", boxNum, "set");
-              }
-            }
-          }
+        if (linkDownSince != 0) {
+          // 切断からの復帰
+          reconnectCount++;
+          linkDowntimeTotal += millis() - linkDownSince;
+          linkDownSince = 0;
+          Log.print("WiFi reconnected (reconnects: ");
+          Log.print(reconnectCount);
+          Log.print(", total downtime: ");
+          Log.print(linkDowntimeTotal);
+          Log.println(" ms)");
+        } else {
+          Log.print("Boot to WiFi connected: ");
+          Log.print(millis());
+          Log.println(" ms");
         }
+        return;
       }
 
-      // POST に対しては簡単なレスポンスのみ返す（JSON でも OK）
-      client.println("HTTP/1.1 200 OK");
-      client.println("Content-Type: application/json");
-      client.println("Access-Control-Allow-Origin: *");
-      client.println("Connection: close");
-      client.println();
-      client.println("{\"status\":\"ok\"}");
-    } else if (isGet) {
-      // --- 通常のブラウザアクセス（GET）には HTML を返す ---
-      sendDynamicPage(client);
-    } else {
-      // それ以外のメソッドには 405 などを返してもよい
-      client.println("HTTP/1.1 405 Method Not Allowed");
-      client.println("Access-Control-Allow-Origin: *");
-      client.println("Access-Control-Allow-Methods: GET, POST, OPTIONS");
-      client.println("Access-Control-Allow-Headers: Content-Type");
-      client.println("Connection: close");
-      client.println();
+      if (millis() - wifiJoinStart < WIFI_JOIN_TIMEOUT) {
+        // まだ接続試行中
+        wifiNextActionTime = millis() + WIFI_JOIN_POLL;
+        return;
+      }
+
+      // 失敗したので指数バックオフで次の試行を予約
+      Log.print("WiFi connect attempt timed out (max scan gap while offline: ");
+      Log.print(scanGapOfflineMaxUs);
+      Log.println(" us)");
+      wifiState = WIFI_STATE_CONNECTING;
+      wifiNextActionTime = millis() + wifiBackoff;
+      wifiBackoff *= 2;
+      if (wifiBackoff > WIFI_BACKOFF_MAX) wifiBackoff = WIFI_BACKOFF_MAX;
+      break;
     }
 
-    // 接続を閉じる
-    client.stop();
-    Serial.println("client disconnected");
+    case WIFI_STATE_CONNECTED: {
+      // リンク監視: 一定間隔で status() のみを確認する（軽量）
+      wifiNextActionTime = currentTime + LINK_CHECK_INTERVAL;
+      status = WiFi.status();
+      if (status != WL_CONNECTED) {
+        markLinkDown(currentTime);
+      }
+      break;
+    }
   }
 }
 
 /**
- * @brief 動的なHTMLページをクライアントに送信します
- * @param client 送信先のWiFiClient
+ * @brief リンク切断を記録し、再接続処理へ移行する
+ * @param currentTime 現在時刻 (millis)
+ *
+ * 通知はキューに残るので、再接続後に順番に送信される。
  */
-void sendDynamicPage(WiFiClient client) {
-  
-  // トグルスイッチの状態も状態配列に反映（リアルタイム表示用）
-  // ただし、実際の状態管理は loop() 内のエッジ検出で行う
+void markLinkDown(unsigned long currentTime) {
+  if (wifiState != WIFI_STATE_CONNECTED) {
+    return;
+  }
 
-  // --- HTTPヘッダー ---
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-type:text/html");
-  client.println("Access-Control-Allow-Origin: *");
-  client.println("Access-Control-Allow-Methods: GET, POST, OPTIONS");
-  client.println("Access-Control-Allow-Headers: Content-Type");
-  client.println("Connection: close"); // レスポンス後に接続を閉じる
-  client.println(); // ヘッダー終了
+  linkDownCount++;
+  linkDownSince = currentTime;
+  if (linkDownSince == 0) linkDownSince = 1; // 0 は「切断中ではない」を表すため
 
-  // --- HTML開始 ---
-  // cc:tweaked通信用の状態情報を先頭に配置（データサイズ削減・パース処理高速化）
-  client.print("<!--BOX_STATUS:");
-  // 2-301室の状態（16区画をカンマ区切りで: 1=赤色, 0=通常）
-  client.print("301:");
-  for (int i = 0; i < 16; i++) {
-    if (i > 0) client.print(",");
-    client.print(box301State[i] ? "1" : "0");
-  }
-  // 2-302室の状態（16区画をカンマ区切りで: 1=赤色, 0=通常）
-  client.print("|302:");
-  for (int i = 0; i < 16; i++) {
-    if (i > 0) client.print(",");
-    client.print(box302State[i] ? "1" : "0");
-  }
-  client.println("-->");
-  
-  client.println("<!DOCTYPE html><html><head>");
-  client.println("<title>欅祭 呼び出しリスト</title>");
-  client.println("<meta charset=\"UTF-8\">");
-  client.println("<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">");
-  client.println("<meta http-equiv=\"refresh\" content=\"5\">");
-  
-  // --- <style> タグとCSSの読み込み ---
-  client.println("<style>");
-  // PROGMEMからCSSをストリーム
-  client.print((const __FlashStringHelper *)STYLE_CSS); 
-  client.println("</style>");
-  
-  client.println("</head><body>");
-  client.println("<h1>欅祭 呼び出しリスト</h1>");
-  client.println("<div class=\"container\">");
-
-  // --- 部屋 2-301 ---
-  client.println("<div class=\"room room-301\">");
-  client.println("<div class=\"room-name\">2-301</div>");
-  client.println("<div class=\"grid-container\">");
-  
-  // 左列（Col 1、上から下）: 1, 2, ▫️, 8, 12, ▫️, 11
-  int box301Left[] = {1, 2, -1, 8, 12, -1, 11};
-  for (int i = 0; i < 7; i++) {
-    int newBox = box301Left[i];
-    client.print("<div class=\"grid-item ");
-    if (newBox != -1) {
-      int oldIdx = ROOM301_NEW_TO_OLD[newBox];
-      if (oldIdx != -1 && box301State[oldIdx]) {
-        client.print("highlighted");
-      }
-    }
-    client.print("\">");
-    if (newBox != -1) {
-      client.print(newBox);
-    }
-    client.println("</div>");
-  }
-  
-  // 中央列（Col 2、上から下）: ◾️(なし), 10, ◾️(なし), 9, ◾️(なし), ◾️(なし), ◾️(なし)
-  int box301Center[] = {-1, 10, -1, 9, -1, -1, -1};
-  for (int i = 0; i < 7; i++) {
-    int newBox = box301Center[i];
-    if (newBox != -1) {
-      client.print("<div class=\"grid-item ");
-      int oldIdx = ROOM301_NEW_TO_OLD[newBox];
-      if (oldIdx != -1 && box301State[oldIdx]) {
-        client.print("highlighted");
-      }
-      client.print("\">");
-      client.print(newBox);
-      client.println("</div>");
-    }
-  }
-  
-  // 右列（Col 3、上から下）: 3, 4, ▫️, 5, ▫️, ▫️, 6
-  int box301Right[] = {3, 4, -1, 5, -1, -1, 6};
-  for (int i = 0; i < 7; i++) {
-    int newBox = box301Right[i];
-    client.print("<div class=\"grid-item ");
-    if (newBox != -1) {
-      int oldIdx = ROOM301_NEW_TO_OLD[newBox];
-      if (oldIdx != -1 && box301State[oldIdx]) {
-        client.print("highlighted");
-      }
-    }
-    client.print("\">");
-    if (newBox != -1) {
-      client.print(newBox);
+  Log.print("WiFi link lost (count: ");
+  Log.print(linkDownCount);
+  Log.println("), reconnecting");
+
+  // 切断で無効になった WebSocket 接続を解放する
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsClients[i].state != WS_FREE) {
+      wsClients[i].client.stop();
+      wsClients[i].state = WS_FREE;
     }
-    client.println("</div>");
   }
-  
-  client.println("</div></div>"); // grid-container, room-301 終了
-
-  // --- 部屋 2-302 ---
-  client.println("<div class=\"room room-302\">");
-  client.println("<div class=\"room-name\">2-302</div>");
-  client.println("<div class=\"grid-container\">");
-
-  // 左列（Col 1、上から下）: 1, 2, ▫️, 3, ▫️, ▫️, ▫️
-  int box302Col1[] = {1, 2, -1, 3, -1, -1, -1};
-  for (int i = 0; i < 7; i++) {
-    int newBox = box302Col1[i];
-    client.print("<div class=\"grid-item ");
-    if (newBox > 0) { // 正の数は区画番号
-      int oldIdx = ROOM302_NEW_TO_OLD[newBox];
-      if (oldIdx != -1 && box302State[oldIdx]) {
-        client.print("highlighted");
-      }
-    }
-    client.print("\">");
-    if (newBox > 0) {
-      client.print(newBox);
+
+  // 受信途中の HTTP 接続も解放する（残すと httpReady() が true のままになり、
+  // 再接続後に切れた相手へ応答することになる）
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (httpConns[i].active) {
+      httpConns[i].client.stop();
+      httpConns[i].active = false;
     }
-    // -1は空のdiv（▫️）
-    client.println("</div>");
   }
-  
-  // Col 2（上から下）: なし, なし, なし, なし, なし, なし, ▫️
-  // Row 7のみ空のdivを表示（▫️）
-  client.print("<div class=\"grid-item ");
-  client.print("\">");
-  client.println("</div>"); // Row 7: ▫️
-  
-  // 中央列（Col 3、上から下）: 空白, なし, ▫️, なし, なし, なし, 4
-  // Row 1は空白（空のdiv）、Row 3は▫️（空のdiv）、Row 7は4
-  client.print("<div class=\"grid-item ");
-  client.print("\">");
-  client.println("</div>"); // Row 1: 空白
-  client.print("<div class=\"grid-item ");
-  client.print("\">");
-  client.println("</div>"); // Row 3: ▫️
-  // Row 7: 4
-  int box302Col3Row7 = 4;
-  client.print("<div class=\"grid-item ");
-  int oldIdxCol3Row7 = ROOM302_NEW_TO_OLD[box302Col3Row7];
-  if (oldIdxCol3Row7 != -1 && box302State[oldIdxCol3Row7]) {
-    client.print("highlighted");
-  }
-  client.print("\">");
-  client.print(box302Col3Row7);
-  client.println("</div>");
-  
-  // Col 4（上から下）: 空白, なし, なし, なし, なし, なし, 空白
-  // Row 1は空白（空のdiv）、Row 7は空白（空のdiv）
-  client.print("<div class=\"grid-item ");
-  client.print("\">");
-  client.println("</div>"); // Row 1: 空白
-  client.print("<div class=\"grid-item ");
-  client.print("\">");
-  client.println("</div>"); // Row 7: 空白
-  
-  // 右列（Col 5、上から下）: 5, 6, ▫️, 7, ▫️, ▫️, ▫️
-  int box302Col5[] = {5, 6, -1, 7, -1, -1, -1};
-  for (int i = 0; i < 7; i++) {
-    int newBox = box302Col5[i];
-    client.print("<div class=\"grid-item ");
-    if (newBox > 0) { // 正の数は区画番号
-      int oldIdx = ROOM302_NEW_TO_OLD[newBox];
-      if (oldIdx != -1 && box302State[oldIdx]) {
-        client.print("highlighted");
-      }
-    }
-    client.print("\">");
-    if (newBox > 0) {
-      client.print(newBox);
+
+  // 応答待ちの通知は再接続後に送り直す（イベントはキューに残っている）
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    if (subscribers[i].used && subscribers[i].state == SUB_WAITING) {
+      subscribers[i].client.stop();
+      subscribers[i].state = SUB_IDLE;
     }
-    // -1は空のdiv（▫️）
-    client.println("</div>");
   }
 
-  client.println("</div></div>"); // grid-container, room-302 終了
+  WiFi.disconnect();
+  wifiState = WIFI_STATE_CONNECTING;
+  wifiBackoff = WIFI_BACKOFF_MIN;
+  wifiNextActionTime = currentTime;
+}
 
-  client.println("</div>"); // container 終了
-  client.println("</body></html>");
-  client.println(); // HTTPレスポンスの最後
+/**
+ * @brief すぐに応答してリクエストを断る（503 / 429）
+ * @param client 送信先のWiFiClient
+ * @param statusLine ステータス行
+ * @param retryAfter Retry-After の秒数
+ */
+void rejectRequest(WiFiClient &client, const char* statusLine, int retryAfter) {
+  client.println(statusLine);
+  client.print("Retry-After: ");
+  client.println(retryAfter);
+  client.println("Access-Control-Allow-Origin: *");
+  client.println("Connection: close");
+  client.println();
+  client.stop();
 }
 
+/**
+ * @brief 送信元IPがアクセス制限の対象外（rateExemptIps）かどうか
+ */
+bool isRateExempt(uint32_t ip) {
+  for (int i = 0; i < RATE_EXEMPT_COUNT; i++) {
+    if ((uint32_t)rateExemptIps[i] == ip) return true;
+  }
+  return false;
+}
 
-// Wi-Fiステータスをシリアルモニタに出力する関数
-void printWifiStatus() {
-  Serial.print("SSID: ");
-  Serial.println(WiFi.SSID());
+/**
+ * @brief 送信元IPのトークンバケットを探し、経過時間分のトークンを補充する
+ * @param ip 送信元IP
+ * @return バケット（初めての送信元には最も長く使われていない枠を満タンで割り当てる）
+ */
+RateBucket &rateBucketFor(uint32_t ip) {
+  unsigned long now = millis();
 
-  IPAddress ip = WiFi.localIP();
-  Serial.print("IP Address: ");
-  Serial.println(ip);
+  int slot = -1;
+  int oldest = 0;
+  for (int i = 0; i < RATE_BUCKETS; i++) {
+    if (rateBuckets[i].ip == ip) {
+      slot = i;
+      break;
+    }
+    if (rateBuckets[i].lastRefill < rateBuckets[oldest].lastRefill) oldest = i;
+  }
+  if (slot == -1) {
+    slot = oldest;
+    rateBuckets[slot].ip = ip;
+    rateBuckets[slot].tokens = RATE_BUCKET_SIZE;
+    rateBuckets[slot].lastRefill = now;
+  }
 
-  long rssi = WiFi.RSSI();
-  Serial.print("signal strength (RSSI):");
-  Serial.print(rssi);
-  Serial.println(" dBm");
-  Serial.print("To see this page in action, open a browser to http://");
-  Serial.println(ip);
+  RateBucket &b = rateBuckets[slot];
+  b.tokens += (now - b.lastRefill) * RATE_REFILL_PER_SEC / 1000.0;
+  if (b.tokens > RATE_BUCKET_SIZE) b.tokens = RATE_BUCKET_SIZE;
+  b.lastRefill = now;
+  return b;
 }
 
 /**
- * @brief cc:tweakedサーバーが設定されているかどうかを確認
- * @return true: 設定済み, false: 未設定
+ * @brief 送信元IPのトークンバケットから cost 個のトークンを取る
+ * @param ip 送信元IP
+ * @param cost 必要なトークン数（0 なら残っているかの確認のみ）
+ * @param reserve 取った後に残さなければならないトークン数
+ * @param retryAfter トークンが足りない場合に、貯まるまでの秒数を返す
+ * @return true: 受け付ける, false: レート制限
  */
-bool isCCTweakedConfigured() {
-  return cctweaked_ip[0] != 0 || cctweaked_ip[1] != 0 || 
-         cctweaked_ip[2] != 0 || cctweaked_ip[3] != 0;
+bool takeRateTokens(uint32_t ip, int cost, int reserve, int &retryAfter) {
+  if (isRateExempt(ip)) return true;
+  RateBucket &b = rateBucketFor(ip);
+  int need = cost > 0 ? cost + reserve : 1;
+  if (b.tokens < need) {
+    retryAfter = (int)((need - b.tokens) / RATE_REFILL_PER_SEC) + 1;
+    return false;
+  }
+  b.tokens -= cost;
+  return true;
 }
 
 /**
- * @brief cc:tweakedサーバーにJSONリクエストを送信
- * @param room 部屋番号 ("302" または "301")
- * @param box 区画番号 (1-16、-1の場合は全解除)
- * @param action アクション ("set" または "clear")
+ * @brief ヘッダーを送り終えずにタイムアウトした送信元にトークンを課す（0 未満にもなる）
+ * @param ip 送信元IP
  */
-void sendToCCTweaked(String room, int box, String action) {
-  if (!isCCTweakedConfigured()) {
+void chargeStall(uint32_t ip) {
+  if (isRateExempt(ip)) return;
+  RateBucket &b = rateBucketFor(ip);
+  b.tokens -= RATE_COST_STALL;
+  if (b.tokens < -RATE_BUCKET_SIZE) b.tokens = -RATE_BUCKET_SIZE;
+}
+
+/**
+ * @brief 受信中の接続数を返す
+ */
+int httpActiveCount() {
+  int n = 0;
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (httpConns[i].active) n++;
+  }
+  return n;
+}
+
+/**
+ * @brief 新しい HTTP 接続を受け付ける（空きがなければ 503 で断る）
+ */
+void acceptClient() {
+  WiFiClient client = server.available();
+  if (!client) {
     return;
   }
 
-  WiFiClient client;
-  
-  Serial.print("Connecting to cc:tweaked server: ");
-  Serial.print(cctweaked_ip);
-  Serial.print(":");
-  Serial.println(cctweaked_port);
+  // available() は受信中の接続も返すので、既存の接続かどうかを確認する
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (httpConns[i].active && httpConns[i].client == client) {
+      return;
+    }
+  }
 
-  if (client.connect(cctweaked_ip, cctweaked_port)) {
-    Serial.println("Connected to cc:tweaked server");
-    
-    // JSON ボディを構築
-    String jsonBody = "{\"room\":\"" + room + "\",\"action\":\"" + action + "\"";
-    if (box > 0) {
-      jsonBody += ",\"box\":" + String(box);
+  // トークンを使い切った送信元からは、接続の枠を使わせる前に断る
+  int retryAfter = 1;
+  if (!takeRateTokens((uint32_t)client.remoteIP(), 0, 0, retryAfter)) {
+    rejectedRateLimit++;
+    rejectRequest(client, "HTTP/1.1 429 Too Many Requests", retryAfter);
+    return;
+  }
+
+  int slot = -1;
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (!httpConns[i].active) {
+      slot = i;
+      break;
     }
-    jsonBody += "}";
-    
-    // HTTP POST リクエストを送信
-    client.println("POST /api/box HTTP/1.1");
-    client.print("Host: ");
-    client.println(cctweaked_ip);
+  }
+  if (slot == -1) {
+    rejectedBusy++;
+    rejectRequest(client, "HTTP/1.1 503 Service Unavailable", 1);
+    return;
+  }
+
+  Log.println("new client");
+
+  // --- シンプルな HTTP パーサ（受信は1回の呼び出しで読める分だけ進める） ---
+  HttpConn &conn = httpConns[slot];
+  conn.client = client;
+  conn.active = true;
+  conn.start = millis();
+  conn.requestLine[0] = '\0';
+  conn.currentLine[0] = '\0';
+  conn.currentLen = 0;
+  conn.body[0] = '\0';
+  conn.bodyLen = 0;
+  conn.idempotencyKey[0] = '\0';
+  conn.adminToken[0] = '\0';
+  conn.isFirstLine = true;
+  conn.headerEnded = false;
+  conn.contentLength = -1;
+  conn.isPriority = false;
+}
+
+/**
+ * @brief 1つの接続からリクエストを読み進める
+ * @param conn 対象の接続
+ * @return true: リクエストを受信し終えた（処理してよい）
+ */
+bool readRequest(HttpConn &conn) {
+  // 1回の呼び出しで読むのは HTTP_READ_CHUNK バイトまで（ボタン処理を待たせないため）
+  int budget = HTTP_READ_CHUNK;
+  while (budget-- > 0 && conn.client.available()) {
+    char c = conn.client.read();
+
+    if (!conn.headerEnded) {
+      // ヘッダー行の処理（\n 区切り）
+      if (c == '\n') {
+        // 1行終わり
+        if (conn.currentLen == 0) {
+          // 空行 = ヘッダー終わり
+          conn.headerEnded = true;
+        } else {
+          if (conn.isFirstLine) {
+            strcpy(conn.requestLine, conn.currentLine);
+            conn.isFirstLine = false;
+            if (!admitRequest(conn)) {
+              return false; // 断ったので接続は閉じられている
+            }
+          } else if (strncasecmp(conn.currentLine, "Idempotency-Key:", 16) == 0) {
+            const char* v = conn.currentLine + 16;
+            while (*v == ' ') v++;
+            strncpy(conn.idempotencyKey, v, HTTP_KEY_MAX - 1);
+            conn.idempotencyKey[HTTP_KEY_MAX - 1] = '\0';
+          } else if (strncasecmp(conn.currentLine, "X-Admin-Token:", 14) == 0) {
+            const char* v = conn.currentLine + 14;
+            while (*v == ' ') v++;
+            strncpy(conn.adminToken, v, HTTP_KEY_MAX - 1);
+            conn.adminToken[HTTP_KEY_MAX - 1] = '\0';
+          } else if (strncasecmp(conn.currentLine, "Content-Length:", 15) == 0) {
+            conn.contentLength = atol(conn.currentLine + 15);
+          }
+          conn.currentLen = 0;
+          conn.currentLine[0] = '\0';
+        }
+      } else if (c != '\r') {
+        if (conn.currentLen < HTTP_LINE_MAX - 1) {
+          conn.currentLine[conn.currentLen] = c;
+          conn.currentLine[conn.currentLen + 1] = '\0';
+        }
+        conn.currentLen++;
+      }
+    } else {
+      // ヘッダー終わり以降はボディとして全部読み込む
+      if (conn.bodyLen < HTTP_BODY_MAX - 1) {
+        conn.body[conn.bodyLen] = c;
+        conn.body[conn.bodyLen + 1] = '\0';
+      }
+      conn.bodyLen++;
+    }
+  }
+
+  // リクエストが揃ったか判定
+  //   Content-Length があればその長さまで、なければヘッダー後に届いている分まで
+  if (conn.headerEnded) {
+    if (conn.contentLength >= 0) {
+      if (conn.bodyLen >= conn.contentLength) return true;
+    } else if (!conn.client.available()) {
+      return true;
+    }
+  }
+  // ヘッダーが届かないまま時間切れ
+  if (!conn.headerEnded && (millis() - conn.start) >= HTTP_HEADER_TIMEOUT) {
+    if (conn.isFirstLine && conn.currentLen == 0) {
+      // 1バイトも届いていない（ブラウザの先読み接続など）: 黙って閉じる
+      conn.client.stop();
+    } else {
+      // 途中まで送ってきた: 408 を返して閉じ、送信元にトークンを課す
+      rejectedStalled++;
+      chargeStall((uint32_t)conn.client.remoteIP());
+      Log.print("Header timeout: ");
+      Log.println(conn.client.remoteIP());
+      rejectRequest(conn.client, "HTTP/1.1 408 Request Timeout", 1);
+    }
+    conn.active = false;
+    return false;
+  }
+
+  // タイムアウト対策（届いた分だけで処理する）
+  return !conn.client.connected() || (millis() - conn.start) >= HTTP_TIMEOUT;
+}
+
+/**
+ * @brief リクエストラインが届いた時点で受け付けるかどうかを決める
+ * @param conn 対象の接続
+ * @return true: 受け付ける, false: 断った（接続は閉じた）
+ *
+ * POST（Nuxt からの操作）を優先するため、GET は使うトークンを多くし、
+ * 最後の空き接続を使う GET は断って POST 用に残す。
+ * ブラウザからの POST の前には CORS のプリフライト（OPTIONS）が届くので、POST と同じ扱いにする。
+ */
+bool admitRequest(HttpConn &conn) {
+  conn.isPriority = strncmp(conn.requestLine, "POST ", 5) == 0 ||
+                    strncmp(conn.requestLine, "OPTIONS ", 8) == 0;
+
+  if (!conn.isPriority && httpActiveCount() >= HTTP_MAX_CONNS) {
+    rejectedBusy++;
+    rejectRequest(conn.client, "HTTP/1.1 503 Service Unavailable", 1);
+    conn.active = false;
+    return false;
+  }
+
+  int retryAfter = 1;
+  int cost = conn.isPriority ? RATE_COST_POST : RATE_COST_GET;
+  int reserve = conn.isPriority ? 0 : RATE_POST_RESERVE;
+  if (!takeRateTokens((uint32_t)conn.client.remoteIP(), cost, reserve, retryAfter)) {
+    rejectedRateLimit++;
+    Log.print("Rate limited: ");
+    Log.println(conn.client.remoteIP());
+    rejectRequest(conn.client, "HTTP/1.1 429 Too Many Requests", retryAfter);
+    conn.active = false;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief 受信し終えたリクエストに応答して接続を閉じる
+ * @param conn 対象の接続
+ */
+void finishRequest(HttpConn &conn) {
+#ifdef MEM_TRACE
+  unsigned long allocsBefore = allocCount;
+#endif
+  serveRequest(conn.client, conn.requestLine, conn.body, conn.idempotencyKey, conn.adminToken);
+#ifdef MEM_TRACE
+  requestAllocsLast = allocCount - allocsBefore;
+  if (requestAllocsLast > requestAllocsMax) requestAllocsMax = requestAllocsLast;
+#endif
+  size_t freeNow = heapFree();
+  if (freeNow < heapFreeMin) heapFreeMin = freeNow;
+
+  // 接続を閉じる
+  conn.client.stop();
+  conn.active = false;
+  Log.println("client disconnected");
+
+  if (!firstServeDone) {
+    firstServeDone = true;
+    bootToFirstServe = millis();
+    Log.print("Boot to first served request: ");
+    Log.print(bootToFirstServe);
+    Log.println(" ms");
+  }
+}
+
+/**
+ * @brief HTTP の受付・受信・応答を1ステップ進める
+ *
+ * 受信し終えた POST（と OPTIONS など）はすべて先に処理し、
+ * 重いページ描画の GET は1回の呼び出しにつき1件だけ処理する。
+ */
+void handleClient() {
+  acceptClient();
+
+  bool complete[HTTP_MAX_CONNS];
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    complete[i] = httpConns[i].active && readRequest(httpConns[i]) && httpConns[i].active;
+  }
+
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (complete[i] && strncmp(httpConns[i].requestLine, "GET ", 4) != 0) {
+      finishRequest(httpConns[i]);
+      complete[i] = false;
+    }
+  }
+  for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+    if (complete[i]) {
+      finishRequest(httpConns[i]);
+      break;
+    }
+  }
+}
+
+/**
+ * @brief 受信し終えたリクエストを処理してレスポンスを返す
+ * @param client 送信先のWiFiClient
+ * @param requestLine リクエストライン（"GET /path HTTP/1.1"）
+ * @param body リクエストボディ
+ * @param idempotencyKey Idempotency-Key ヘッダーの値（なければ空）
+ * @param adminToken X-Admin-Token ヘッダーの値（なければ空）
+ */
+void serveRequest(WiFiClient &client, char* requestLine, const char* body, const char* idempotencyKey,
+                  const char* adminToken) {
+  // 末尾の空白を除去
+  int lineLen = strlen(requestLine);
+  while (lineLen > 0 && requestLine[lineLen - 1] == ' ') requestLine[--lineLen] = '\0';
+  Log.print("Request Line: ");
+  Log.println(requestLine);
+
+  // --- メソッド判定 ---
+  bool isPost    = strncmp(requestLine, "POST ", 5) == 0;
+  bool isGet     = strncmp(requestLine, "GET ", 4) == 0;
+  bool isOptions = strncmp(requestLine, "OPTIONS ", 8) == 0;
+  bool isDelete  = strncmp(requestLine, "DELETE ", 7) == 0;
+
+  // リクエストラインからパスを取り出す（"GET /path HTTP/1.1"）
+  char path[HTTP_LINE_MAX];
+  const char* pathStart = strchr(requestLine, ' ');
+  pathStart = pathStart ? pathStart + 1 : requestLine + lineLen;
+  const char* pathEnd = strchr(pathStart, ' ');
+  size_t pathLen = pathEnd ? (size_t)(pathEnd - pathStart) : strlen(pathStart);
+  if (pathLen >= sizeof(path)) pathLen = sizeof(path) - 1;
+  memcpy(path, pathStart, pathLen);
+  path[pathLen] = '\0';
+  bool isSubscribers = strncmp(path, "/api/subscribers", 16) == 0;
+
+  if (isOptions) {
+    // --- CORS プリフライト用のレスポンス ---
+    client.println("HTTP/1.1 204 No Content");
+    client.println("Access-Control-Allow-Origin: *");
+    client.println("Access-Control-Allow-Methods: GET, POST, DELETE, OPTIONS");
+    client.println("Access-Control-Allow-Headers: Content-Type, Idempotency-Key, X-Admin-Token");
+    client.println("Connection: close");
+    client.println();
+  } else if (isPost && isSubscribers) {
+    // --- 通知先の登録 ---
+    if (adminAuthorized(client, adminToken)) handleSubscriberPost(client, body);
+  } else if (isDelete && isSubscribers) {
+    // --- 通知先の削除 ---
+    if (adminAuthorized(client, adminToken)) handleSubscriberDelete(client, path);
+  } else if (isPost) {
+    // Cloudflare Tunnel 経由で Nuxt から来る JSON を想定
+    Log.print("POST body: ");
+    Log.println(body);
+
+    // 再送（Cloudflare Tunnel / Nuxt のリトライ）は反映も通知もしない
+    CommandId id;
+    bool duplicate = isDuplicateCommand(body, idempotencyKey, id);
+    if (!duplicate && applyCommand(body)) {
+      recordCommand(id);
+    }
+
+    // POST に対しては簡単なレスポンスのみ返す（JSON でも OK）
+    client.println("HTTP/1.1 200 OK");
     client.println("Content-Type: application/json");
-    client.print("Content-Length: ");
-    client.println(jsonBody.length());
+    client.println("Access-Control-Allow-Origin: *");
     client.println("Connection: close");
     client.println();
-    client.println(jsonBody);
-    
-    Serial.print("Sent to cc:tweaked: ");
-    Serial.println(jsonBody);
-    
-    // レスポンスを待つ（タイムアウト: 5秒）
-    unsigned long timeout = millis();
-    while (client.available() == 0) {
-      if (millis() - timeout > 5000) {
-        Serial.println(">>> Client Timeout !");
-        client.stop();
-        return;
+    client.println(duplicate ? "{\"status\":\"duplicate\"}" : "{\"status\":\"ok\"}");
+  } else if (isGet) {
+    if (strncmp(path, "/api/changes", 12) == 0) {
+      // --- 差分同期 API ---
+      sendChanges(client, path);
+    } else if (strncmp(path, "/api/metrics", 12) == 0) {
+      // --- タスク・リンクの計測値 ---
+      sendMetrics(client);
+    } else if (strncmp(path, "/api/stats", 10) == 0) {
+      // --- 呼び出しの集計 ---
+      sendStats(client);
+    } else if (isSubscribers) {
+      // --- 通知先の一覧 ---
+      sendSubscribers(client);
+    } else {
+      // --- 通常のブラウザアクセス（GET）には HTML を返す ---
+      sendDynamicPage(client);
+    }
+  } else {
+    // それ以外のメソッドには 405 などを返してもよい
+    client.println("HTTP/1.1 405 Method Not Allowed");
+    client.println("Access-Control-Allow-Origin: *");
+    client.println("Access-Control-Allow-Methods: GET, POST, DELETE, OPTIONS");
+    client.println("Access-Control-Allow-Headers: Content-Type");
+    client.println("Connection: close");
+    client.println();
+  }
+
+  // 接続を閉じる
+}
+
+/**
+ * @brief GET /api/metrics に応答する（タスクごとの実行時間・リンク監視・キューの状態）
+ * @param client 送信先のWiFiClient
+ */
+void sendMetrics(WiFiClient &client) {
+  client.println("HTTP/1.1 200 OK");
+  client.println("Content-Type: application/json");
+  client.println("Access-Control-Allow-Origin: *");
+  client.println("Cache-Control: no-store");
+  client.println("Connection: close");
+  client.println();
+
+  char buf[160];
+  snprintf(buf, sizeof(buf), "{\"uptime\":%lu,\"scanGapMaxUs\":%lu,\"sleeps\":%lu,",
+           millis(), scanGapMaxUs, sleepCount);
+  client.print(buf);
+  // 起動時間（まだ起きていなければ 0）
+  snprintf(buf, sizeof(buf), "\"boot\":{\"toFirstScanMs\":%lu,\"toFirstServeMs\":%lu},\"tasks\":[",
+           bootToFirstScan, bootToFirstServe);
+  client.print(buf);
+  for (int i = 0; i < TASK_COUNT; i++) {
+    const Task &t = tasks[i];
+    snprintf(buf, sizeof(buf),
+             "%s{\"name\":\"%s\",\"runs\":%lu,\"avgUs\":%lu,\"maxUs\":%lu,\"budgetUs\":%lu,\"overruns\":%lu}",
+             i > 0 ? "," : "", t.name, t.runs, t.runs ? t.totalUs / t.runs : 0,
+             t.maxUs, t.budgetUs, t.overruns);
+    client.print(buf);
+  }
+  snprintf(buf, sizeof(buf),
+           "],\"link\":{\"up\":%s,\"downCount\":%lu,\"reconnects\":%lu,\"downtimeMs\":%lu,\"scanGapOfflineMaxUs\":%lu},",
+           wifiState == WIFI_STATE_CONNECTED ? "true" : "false",
+           linkDownCount, reconnectCount, linkDowntimeTotal, scanGapOfflineMaxUs);
+  client.print(buf);
+  snprintf(buf, sizeof(buf),
+           "\"notify\":{\"queued\":%d,\"dropped\":%lu},\"duplicates\":%lu,\"logDropped\":%lu,\"matrixRedraws\":%lu,",
+           notifyPendingCount(), notifyDropped, duplicateCount, Log.dropped, matrixRedraws);
+  client.print(buf);
+  snprintf(buf, sizeof(buf),
+           "\"http\":{\"inFlight\":%d,\"rejectedBusy\":%lu,\"rejectedRateLimit\":%lu,\"rejectedStalled\":%lu},\"announced\":%lu,",
+           httpActiveCount(), rejectedBusy, rejectedRateLimit, rejectedStalled, announceSent);
+  client.print(buf);
+  snprintf(buf, sizeof(buf),
+           "\"mem\":{\"heapFree\":%u,\"heapFreeMin\":%u,\"heapLargestFree\":%u,\"stackUsed\":%u",
+           (unsigned)heapFree(), (unsigned)(heapFreeMin == (size_t)-1 ? heapFree() : heapFreeMin),
+           (unsigned)heapLargestFree(), (unsigned)stackUsed());
+  client.print(buf);
+#ifdef MEM_TRACE
+  snprintf(buf, sizeof(buf),
+           ",\"allocs\":%lu,\"allocBytes\":%lu,\"frees\":%lu,\"requestAllocsLast\":%lu,\"requestAllocsMax\":%lu",
+           allocCount, allocBytes, freeCount, requestAllocsLast, requestAllocsMax);
+  client.print(buf);
+#endif
+  client.println("}}");
+}
+
+/**
+ * @brief 未使用のスタック領域を STACK_PAINT で塗りつぶす（setup() の最初で1回だけ呼ぶ）
+ */
+void paintStack() {
+  if (&__StackLimit == nullptr || &__StackTop == nullptr) return;
+  uint8_t* p = (uint8_t*)&__StackLimit;
+  uint8_t* end = (uint8_t*)__get_MSP() - STACK_PAINT_MARGIN;
+  while (p < end) {
+    *p++ = STACK_PAINT;
+  }
+}
+
+/**
+ * @brief 起動してからのスタックの最大使用量を返す
+ * @return バイト数（計測できない環境では 0）
+ */
+size_t stackUsed() {
+  if (&__StackLimit == nullptr || &__StackTop == nullptr) return 0;
+  // 下端から塗った値が残っている所までは一度も使われていない
+  const uint8_t* p = (const uint8_t*)&__StackLimit;
+  const uint8_t* top = (const uint8_t*)&__StackTop;
+  while (p < top && *p == STACK_PAINT) {
+    p++;
+  }
+  return top - p;
+}
+
+/**
+ * @brief 空きヒープの合計を返す（解放済みブロック + まだ sbrk していない領域）
+ * @return バイト数
+ */
+size_t heapFree() {
+  struct mallinfo mi = mallinfo();
+  size_t unclaimed = 0;
+  if (&__HeapLimit != nullptr) {
+    unclaimed = (char*)&__HeapLimit - (char*)_sbrk(0);
+  }
+  return mi.fordblks + unclaimed;
+}
+
+/**
+ * @brief 1回の malloc で確保できる最大サイズを二分探索で調べる（断片化の目安）
+ * @return バイト数
+ */
+size_t heapLargestFree() {
+  size_t lo = 0;
+  size_t hi = heapFree();
+  while (lo < hi) {
+    size_t mid = (lo + hi + 1) / 2;
+#ifdef MEM_TRACE
+    // 計測用の確保は回数に含めない
+    void* p = __real_malloc(mid);
+    if (p != nullptr) {
+      __real_free(p);
+#else
+    void* p = malloc(mid);
+    if (p != nullptr) {
+      free(p);
+#endif
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/**
+ * @brief 動的なHTMLページをクライアントに送信します
+ * @param client 送信先のWiFiClient
+ */
+void sendDynamicPage(WiFiClient client) {
+  // 小さな print を溜めてまとめて送る（WiFi モジュールへの書き込み回数を減らす）
+  BufferedWriter out(client);
+  
+  // トグルスイッチの状態も状態配列に反映（リアルタイム表示用）
+  // ただし、実際の状態管理は loop() 内のエッジ検出で行う
+
+  // --- HTTPヘッダー ---
+  out.println("HTTP/1.1 200 OK");
+  out.println("Content-type:text/html");
+  out.println("Access-Control-Allow-Origin: *");
+  out.println("Access-Control-Allow-Methods: GET, POST, DELETE, OPTIONS");
+  out.println("Access-Control-Allow-Headers: Content-Type");
+  out.println("Connection: close"); // レスポンス後に接続を閉じる
+  out.println(); // ヘッダー終了
+
+  // --- HTML開始 ---
+  // cc:tweaked通信用の状態情報を先頭に配置（データサイズ削減・パース処理高速化）
+  out.print("<!--BOX_STATUS:");
+  // 2-301室の状態（16区画をカンマ区切りで: 1=赤色, 0=通常）
+  out.print("301:");
+  for (int i = 0; i < 16; i++) {
+    if (i > 0) out.print(",");
+    out.print(box301State[i] ? "1" : "0");
+  }
+  // 2-302室の状態（16区画をカンマ区切りで: 1=赤色, 0=通常）
+  out.print("|302:");
+  for (int i = 0; i < 16; i++) {
+    if (i > 0) out.print(",");
+    out.print(box302State[i] ? "1" : "0");
+  }
+  // クラスタの他ボードが担当する部屋（区画1~16の順）
+  for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+    if (!cluster.rooms[r].used) continue;
+    out.print("|");
+    out.print(cluster.rooms[r].room);
+    out.print(":");
+    for (int b = 0; b < 16; b++) {
+      if (b > 0) out.print(",");
+      out.print((cluster.rooms[r].mask >> b) & 1 ? "1" : "0");
+    }
+  }
+  out.println("-->");
+  
+  out.println("<!DOCTYPE html><html><head>");
+  out.println("<title>欅祭 呼び出しリスト</title>");
+  out.println("<meta charset=\"UTF-8\">");
+  out.println("<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">");
+  out.println("<meta http-equiv=\"refresh\" content=\"5\">");
+  
+  // --- <style> タグとCSSの読み込み ---
+  out.println("<style>");
+  // PROGMEMからCSSをストリーム
+  out.print((const __FlashStringHelper *)STYLE_CSS); 
+  out.println("</style>");
+  
+  out.println("</head><body>");
+  out.println("<h1>欅祭 呼び出しリスト</h1>");
+  out.println("<div class=\"container\">");
+
+  // --- 部屋ごとにレイアウト表から描画（このボードが担当する部屋） ---
+  for (int i = 0; i < ROOM_LAYOUT_COUNT; i++) {
+    const RoomLayout &layout = ROOM_LAYOUTS[i];
+    renderRoom(out, layout.room, layout, localRoomMask(layout.room));
+  }
+
+  // --- クラスタの他ボードが担当する部屋（区画1~16の標準レイアウト） ---
+  for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+    if (!cluster.rooms[r].used) continue;
+    renderRoom(out, cluster.rooms[r].room, DEFAULT_ROOM_LAYOUT, cluster.rooms[r].mask);
+  }
+
+  out.print("</div>"); // container 終了
+  out.println("</body></html>");
+  out.flush();
+}
+
+/**
+ * @brief 1部屋分のグリッドをレイアウト表に従って出力する
+ * @param out 出力先
+ * @param room 部屋番号（表示名 "2-<部屋番号>" に使う）
+ * @param layout レイアウト表
+ * @param mask 区画のビットマスク（bit (n-1) = 区画 n がハイライト）
+ *
+ * セルは行優先で出力し、配置は CSS グリッドの自動配置に任せる。
+ * 「なし」のセルは見えない <i></i> で位置だけを詰め、最後の行の末尾の「なし」は省略する。
+ */
+void renderRoom(Print &out, int room, const RoomLayout &layout, uint16_t mask) {
+  // 見出しは長さが部屋ごとに変わるので、固定長のバッファを使わずに直接書く
+  out.print("<div class=\"room room-");
+  out.print(room);
+  out.print("\"><div class=\"room-name\">2-");
+  out.print(room);
+  out.print("</div><div class=\"grid-container\" style=\"grid-template-columns:repeat(");
+  out.print(layout.cols);
+  out.print(",1fr);--w:");
+  out.print(layout.cellWidth);
+  out.print("px\">");
+
+  // 末尾の「なし」セルは出力不要
+  int last = layout.cols * layout.rows - 1;
+  while (last >= 0 && layout.cells[last] == CELL_NONE) last--;
+
+  for (int i = 0; i <= last; i++) {
+    int cell = layout.cells[i];
+    if (cell == CELL_NONE) {
+      out.print("<i></i>");
+    } else if (cell == CELL_EMPTY) {
+      out.print("<div class=\"grid-item\"></div>");
+    } else {
+      bool on = (mask >> (cell - 1)) & 1;
+      out.print(on ? "<div class=\"grid-item highlighted\">" : "<div class=\"grid-item\">");
+      out.print(cell);
+      out.print("</div>");
+    }
+  }
+  out.println("</div></div>"); // grid-container, room 終了
+}
+
+
+/**
+ * @brief POST ボディの JSON コマンドを状態に反映する
+ * @param body リクエストボディ
+ * @return true: 有効なコマンドとして受け付けた（状態が変わらなかった場合も含む）
+ */
+bool applyCommand(const char* body) {
+  // JSON パース: {"room": "203", "box": 3, "action": "set"} または {"productNumber": 3} (後方互換)
+  char value[16];
+  bool accepted = false;
+
+  // 後方互換性: productNumber の処理（部屋302として処理）
+  if (jsonField(body, "productNumber", value, sizeof(value))) {
+    int num = atoi(value);
+
+    if (num >= 1 && num <= 16) {
+      // 新しい区画番号を古いインデックスに変換
+      int oldIdx = ROOM302_NEW_TO_OLD[num];
+      if (oldIdx != -1) {
+        box302State[oldIdx] = true;
+        Log.print("productNumber: box302State[新区画");
+        Log.print(num);
+        Log.print(" -> 古いインデックス");
+        Log.print(oldIdx);
+        Log.println("] = true");
+        
+        // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+        accepted = true;
+        recordChange("302", num, "set");
       }
     }
-    
-    // レスポンスを読み込んで表示
-    while (client.available()) {
-      String line = client.readStringUntil('\r');
-      Serial.print(line);
+  }
+
+  // 新しい形式: {"room": "302", "box": 3, "action": "set"} または {"room": "302", "action": "clear"}
+  char roomStr[8];
+  if (jsonField(body, "room", roomStr, sizeof(roomStr))) {
+    // box の値を取得（オプション）
+    int boxNum = -1;
+    if (jsonField(body, "box", value, sizeof(value))) {
+      boxNum = atoi(value);
     }
-    Serial.println();
-    
-    client.stop();
-    Serial.println("Connection to cc:tweaked closed");
+
+    // action の値を取得
+    char actionStr[8];
+    jsonField(body, "action", actionStr, sizeof(actionStr));
+
+    // 処理実行
+    if (strcmp(roomStr, "302") == 0) {
+      if (strcmp(actionStr, "clear") == 0) {
+        // 全解除
+        if (boxNum >= 1 && boxNum <= 16) {
+          // 新しい区画番号を古いインデックスに変換
+          int oldIdx = ROOM302_NEW_TO_OLD[boxNum];
+          if (oldIdx != -1) {
+            box302State[oldIdx] = false;
+            Log.print("Clear box302State[新区画");
+            Log.print(boxNum);
+            Log.print(" -> 古いインデックス");
+            Log.print(oldIdx);
+            Log.println("] = false");
+            
+            // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+            accepted = true;
+            recordChange("302", boxNum, "clear");
+          }
+        } else {
+          // box が指定されていない場合は全解除
+          for (int i = 0; i < 16; i++) {
+            box302State[i] = false;
+          }
+          Log.println("Clear all box302State = false");
+          
+          // 全解除の場合は、cc:tweakedに通知（box=nullで送信）
+          accepted = true;
+          recordChange("302", -1, "clear"); // box=-1は全解除を示す
+        }
+      } else if (strcmp(actionStr, "set") == 0 && boxNum >= 1 && boxNum <= 16) {
+        // 新しい区画番号を古いインデックスに変換
+        int oldIdx = ROOM302_NEW_TO_OLD[boxNum];
+        if (oldIdx != -1) {
+          box302State[oldIdx] = true;
+          Log.print("Set box302State[新区画");
+          Log.print(boxNum);
+          Log.print(" -> 古いインデックス");
+          Log.print(oldIdx);
+          Log.println("] = true");
+          
+          // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+          accepted = true;
+          recordChange("302", boxNum, "set");
+        }
+      }
+    } else if (strcmp(roomStr, "301") == 0) {
+      if (strcmp(actionStr, "clear") == 0) {
+        // 全解除
+        if (boxNum >= 1 && boxNum <= 16) {
+          // 新しい区画番号を古いインデックスに変換
+          int oldIdx = ROOM301_NEW_TO_OLD[boxNum];
+          if (oldIdx != -1) {
+            box301State[oldIdx] = false;
+            Log.print("Clear box301State[新区画");
+            Log.print(boxNum);
+            Log.print(" -> 古いインデックス");
+            Log.print(oldIdx);
+            Log.println("] = false");
+            
+            // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+            accepted = true;
+            recordChange("301", boxNum, "clear");
+          }
+        } else {
+          // box が指定されていない場合は全解除
+          for (int i = 0; i < 16; i++) {
+            box301State[i] = false;
+          }
+          Log.println("Clear all box301State = false");
+          
+          // 全解除の場合は、cc:tweakedに通知（box=nullで送信）
+          accepted = true;
+          recordChange("301", -1, "clear"); // box=-1は全解除を示す
+        }
+      } else if (strcmp(actionStr, "set") == 0 && boxNum >= 1 && boxNum <= 16) {
+        // 新しい区画番号を古いインデックスに変換
+        int oldIdx = ROOM301_NEW_TO_OLD[boxNum];
+        if (oldIdx != -1) {
+          box301State[oldIdx] = true;
+          Log.print("Set box301State[新区画");
+          Log.print(boxNum);
+          Log.print(" -> 古いインデックス");
+          Log.print(oldIdx);
+          Log.println("] = true");
+          
+          // 状態が変化したので、変更履歴に記録してcc:tweakedに通知（新しい区画番号を使用）
+          accepted = true;
+          recordChange("301", boxNum, "set");
+        }
+      }
+    } else if (clusterEnabled) {
+      // 他のボードが担当する部屋: 担当ボードへ転送する
+      accepted = clusterForwardCommand(roomStr, boxNum, actionStr);
+    }
+  }
+  return accepted;
+}
+
+/**
+ * @brief JSON から単純なフィールド値を取り出す（引用符と前後の空白を除去）
+ * @param body JSON 文字列
+ * @param name フィールド名（引用符なし）
+ * @param out 値の出力先（見つからなければ空文字）
+ * @param outSize 出力先のサイズ（超えた分は切り捨て）
+ * @return true: フィールドが見つかった
+ */
+bool jsonField(const char* body, const char* name, char* out, size_t outSize) {
+  out[0] = '\0';
+  size_t nameLen = strlen(name);
+
+  // "name" を探す
+  const char* p = body;
+  while ((p = strchr(p, '"')) != nullptr) {
+    if (strncmp(p + 1, name, nameLen) == 0 && p[1 + nameLen] == '"') break;
+    p++;
+  }
+  if (p == nullptr) return false;
+
+  const char* colon = strchr(p + nameLen + 2, ':');
+  if (colon == nullptr) return false;
+
+  // 値は ':' の次から ',' または '}' の手前まで
+  const char* v = colon + 1;
+  size_t len = 0;
+  for (; *v != '\0' && *v != ',' && *v != '}'; v++) {
+    if (*v == '"') continue;
+    if (len == 0 && (*v == ' ' || *v == '\t' || *v == '\r' || *v == '\n')) continue;
+    if (len < outSize - 1) out[len++] = *v;
+  }
+  while (len > 0 && (out[len - 1] == ' ' || out[len - 1] == '\t' ||
+                     out[len - 1] == '\r' || out[len - 1] == '\n')) {
+    len--;
+  }
+  out[len] = '\0';
+  return true;
+}
+
+/**
+ * @brief 文字列の 32bit FNV-1a ハッシュ（0 は未使用を表すので避ける）
+ */
+uint32_t hashString(const char* str) {
+  uint32_t h = 2166136261UL;
+  while (*str) {
+    h ^= (uint8_t)*str++;
+    h *= 16777619UL;
+  }
+  return h == 0 ? 1 : h;
+}
+
+/**
+ * @brief 再送・古いコマンドかどうかを判定する（記録はしない）
+ * @param body リクエストボディ
+ * @param headerKey Idempotency-Key ヘッダーの値（なければ空）
+ * @param id 取り出した識別子の出力先（受け付けたら recordCommand() に渡す）
+ * @return true: 重複または古い（反映しない）, false: 新しいコマンド
+ *
+ * 識別子が付いていないコマンドは従来通り常に反映する。
+ */
+bool isDuplicateCommand(const char* body, const char* headerKey, CommandId &id) {
+  id.clientHash = 0;
+  id.seq = 0;
+  id.keyHash = 0;
+
+  // --- clientId + seq ---
+  char clientId[HTTP_KEY_MAX];
+  char seqStr[16];
+  if (jsonField(body, "clientId", clientId, sizeof(clientId)) && clientId[0] != '\0' &&
+      jsonField(body, "seq", seqStr, sizeof(seqStr)) && seqStr[0] != '\0') {
+    id.clientHash = hashString(clientId);
+    id.seq = atol(seqStr);
+
+    for (int i = 0; i < DEDUPE_CLIENTS; i++) {
+      const DedupeClient &c = dedupeClients[i];
+      if (c.clientHash != id.clientHash) continue;
+      bool expired = millis() - c.lastUsed >= DEDUPE_TTL;
+      bool restarted = id.seq <= c.lastSeq - DEDUPE_RESTART_GAP;
+      if (!expired && !restarted && id.seq <= c.lastSeq) {
+        duplicateCount++;
+        Log.print("Duplicate/stale command ignored: clientId=");
+        Log.print(clientId);
+        Log.print(" seq=");
+        Log.println(id.seq);
+        return true;
+      }
+      break;
+    }
+    return false;
+  }
+
+  // --- 冪等キー ---
+  char key[HTTP_KEY_MAX];
+  if (headerKey[0] != '\0') {
+    strncpy(key, headerKey, sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
   } else {
-    Serial.println("Connection to cc:tweaked failed");
+    jsonField(body, "key", key, sizeof(key));
+  }
+  if (key[0] != '\0') {
+    id.keyHash = hashString(key);
+    for (int i = 0; i < DEDUPE_KEYS; i++) {
+      if (dedupeKeys[i] == id.keyHash) {
+        duplicateCount++;
+        Log.print("Duplicate command ignored: key=");
+        Log.println(key);
+        return true;
+      }
+    }
   }
-}
\ No newline at end of file
+
+  return false;
+}
+
+/**
+ * @brief 受け付けたコマンドの識別子を記録し、以後の再送を isDuplicateCommand() で検出できるようにする
+ * @param id isDuplicateCommand() で取り出した識別子
+ */
+void recordCommand(const CommandId &id) {
+  if (id.clientHash != 0) {
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < DEDUPE_CLIENTS; i++) {
+      if (dedupeClients[i].clientHash == id.clientHash) {
+        slot = i;
+        break;
+      }
+      if (dedupeClients[i].lastUsed < dedupeClients[oldest].lastUsed) oldest = i;
+    }
+    if (slot == -1) {
+      // 新しいクライアント: 空き（lastUsed=0）か最も長く使われていない枠を使う
+      slot = oldest;
+      dedupeClients[slot].clientHash = id.clientHash;
+    }
+    dedupeClients[slot].lastSeq = id.seq;
+    dedupeClients[slot].lastUsed = millis() | 1; // 0 は未使用を表す
+  } else if (id.keyHash != 0) {
+    dedupeKeys[dedupeKeyNext] = id.keyHash;
+    dedupeKeyNext = (dedupeKeyNext + 1) % DEDUPE_KEYS;
+  }
+}
+
+// Wi-Fiステータスをシリアルモニタに出力する関数
+void printWifiStatus() {
+  Log.print("SSID: ");
+  Log.println(WiFi.SSID());
+
+  IPAddress ip = WiFi.localIP();
+  Log.print("IP Address: ");
+  Log.println(ip);
+
+  long rssi = WiFi.RSSI();
+  Log.print("signal strength (RSSI):");
+  Log.print(rssi);
+  Log.println(" dBm");
+  Log.print("To see this page in action, open a browser to http://");
+  Log.println(ip);
+}
+
+/**
+ * @brief cc:tweakedサーバーが設定されているかどうかを確認
+ * @return true: 設定済み, false: 未設定
+ */
+bool isCCTweakedConfigured() {
+  return cctweaked_ip[0] != 0 || cctweaked_ip[1] != 0 || 
+         cctweaked_ip[2] != 0 || cctweaked_ip[3] != 0;
+}
+
+/**
+ * @brief 状態変化を変更履歴に記録し、cc:tweakedへの通知をキューに積む
+ * @param room 部屋番号 ("302" または "301")
+ * @param box 区画番号 (1-16、-1の場合は全解除)
+ * @param action アクション ("set" または "clear")
+ */
+void recordChange(const char* room, int box, const char* action) {
+  int roomNum = atoi(room);
+  journalAppend(roomNum, box, strcmp(action, "set") == 0);
+  statsRecord(roomNum, box, strcmp(action, "set") == 0);
+
+  // クラスタのピアへ新しいバージョンを配る
+  for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+    if (LOCAL_ROOMS[i] == roomNum) {
+      clusterLocalVersion[i]++;
+      cluster.dirty = true;
+      localChangeSeq++;
+    }
+  }
+
+  queueNotify(room, box, action);
+}
+
+/**
+ * @brief EEPROM の起動回数を1つ増やし、bootId にする（setup() で1回だけ呼ぶ）
+ */
+void initBootId() {
+  BootStore store;
+  EEPROM.get(BOOT_EEPROM_ADDR, store);
+  if (store.magic != BOOT_EEPROM_MAGIC) {
+    store.magic = BOOT_EEPROM_MAGIC;
+    store.count = 0;
+  }
+  store.count++;
+  if (store.count == 0) store.count = 1; // 0 は「boot を送っていない」を表すため
+  EEPROM.put(BOOT_EEPROM_ADDR, store);
+  bootId = store.count;
+}
+
+/**
+ * @brief 変更履歴に1件追加する（満杯の場合は最も古い記録を上書き）
+ * @param room 部屋番号
+ * @param box 区画番号 (1-16、-1の場合は全解除)
+ * @param set true: "set", false: "clear"
+ */
+void journalAppend(int room, int box, bool set) {
+  JournalEntry &e = journal[journalSeq % JOURNAL_SIZE];
+  journalSeq++;
+  e.seq = journalSeq;
+  e.time = millis();
+  e.room = room;
+  e.box = box;
+  e.set = set;
+  if (journalCount < JOURNAL_SIZE) journalCount++;
+}
+
+/**
+ * @brief 状態変化を区画ごとの集計に反映する（recordChange から呼ぶ）
+ * @param room 部屋番号（担当する部屋以外は無視）
+ * @param box 区画番号 (1-16、-1の場合は全解除)
+ * @param set true: "set", false: "clear"
+ */
+void statsRecord(int room, int box, bool set) {
+  int r = -1;
+  for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+    if (LOCAL_ROOMS[i] == room) r = i;
+  }
+  if (r == -1) return;
+
+  unsigned long now = millis();
+  int first = (box == -1) ? 1 : box;
+  int last = (box == -1) ? 16 : box;
+  if (first < 1 || last > 16) return;
+
+  for (int b = first; b <= last; b++) {
+    BoxStats &st = boxStats[r][b - 1];
+    if (set) {
+      // すでに set されている区画の再度の set は数えない
+      if (!st.open) {
+        st.open = true;
+        st.openSince = now;
+        st.calls++;
+      }
+    } else if (st.open) {
+      st.open = false;
+      unsigned long sec = (now - st.openSince) / 1000;
+      int bucket = 0;
+      while (bucket < STATS_BUCKETS - 1 && sec >= STATS_BUCKET_LIMITS[bucket]) bucket++;
+      if (st.hist[bucket] < 0xFFFF) st.hist[bucket]++;
+      st.cleared++;
+      st.sumSec += sec;
+      if (sec > st.maxSec) st.maxSec = sec;
+    }
+  }
+}
+
+/**
+ * @brief GET /api/stats に応答する（部屋ごと・区画ごとの呼び出し回数と応答時間）
+ * @param client 応答先のクライアント
+ *
+ * 応答例:
+ * {"uptime":123456,"buckets":[15,30,...],"rooms":[{"room":301,"calls":3,"cleared":2,
+ *  "open":1,"sumSec":95,"maxSec":70,"hist":[0,1,0,1,0,0,0,0],
+ *  "boxes":[{"box":2,"calls":2,"cleared":1,"sumSec":25,"maxSec":25,"openSec":12,"hist":[...]}]}]}
+ * boxes には1回以上呼ばれた区画だけを含める。openSec は clear されていなければ経過秒数、されていれば -1。
+ */
+void sendStats(WiFiClient &client) {
+  BufferedWriter out(client);
+  out.println("HTTP/1.1 200 OK");
+  out.println("Content-Type: application/json");
+  out.println("Access-Control-Allow-Origin: *");
+  out.println("Cache-Control: no-store");
+  out.println("Connection: close");
+  out.println();
+
+  unsigned long now = millis();
+  char buf[128];
+  snprintf(buf, sizeof(buf), "{\"uptime\":%lu,\"buckets\":[", now);
+  out.print(buf);
+  for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+    if (i > 0) out.print(',');
+    out.print(STATS_BUCKET_LIMITS[i]);
+  }
+  out.print("],\"rooms\":[");
+
+  for (int r = 0; r < LOCAL_ROOM_COUNT; r++) {
+    // 部屋の集計は区画の値を足し合わせる
+    unsigned long calls = 0, cleared = 0, sumSec = 0, maxSec = 0;
+    int open = 0;
+    unsigned long hist[STATS_BUCKETS] = {0};
+    for (int b = 0; b < 16; b++) {
+      const BoxStats &st = boxStats[r][b];
+      calls += st.calls;
+      cleared += st.cleared;
+      sumSec += st.sumSec;
+      if (st.maxSec > maxSec) maxSec = st.maxSec;
+      if (st.open) open++;
+      for (int h = 0; h < STATS_BUCKETS; h++) hist[h] += st.hist[h];
+    }
+    snprintf(buf, sizeof(buf),
+             "%s{\"room\":%d,\"calls\":%lu,\"cleared\":%lu,\"open\":%d,\"sumSec\":%lu,\"maxSec\":%lu,\"hist\":[",
+             r > 0 ? "," : "", LOCAL_ROOMS[r], calls, cleared, open, sumSec, maxSec);
+    out.print(buf);
+    for (int h = 0; h < STATS_BUCKETS; h++) {
+      if (h > 0) out.print(',');
+      out.print(hist[h]);
+    }
+    out.print("],\"boxes\":[");
+
+    bool firstBox = true;
+    for (int b = 0; b < 16; b++) {
+      const BoxStats &st = boxStats[r][b];
+      if (st.calls == 0) continue;
+      long openSec = st.open ? (long)((now - st.openSince) / 1000) : -1;
+      snprintf(buf, sizeof(buf),
+               "%s{\"box\":%d,\"calls\":%lu,\"cleared\":%lu,\"sumSec\":%lu,\"maxSec\":%lu,\"openSec\":%ld,\"hist\":[",
+               firstBox ? "" : ",", b + 1, st.calls, st.cleared, st.sumSec, st.maxSec, openSec);
+      out.print(buf);
+      for (int h = 0; h < STATS_BUCKETS; h++) {
+        if (h > 0) out.print(',');
+        out.print(st.hist[h]);
+      }
+      out.print("]}");
+      firstBox = false;
+    }
+    out.print("]}");
+  }
+  out.println("]}");
+  out.flush();
+}
+
+/**
+ * @brief GET /api/changes?since=N&boot=B に応答する
+ * @param client 送信先のWiFiClient
+ * @param path リクエストパス（クエリ文字列を含む）
+ *
+ * N より後の変更を返す。N が履歴の範囲外（古すぎる、またはボードが再起動して
+ * N が現在のシーケンス番号より大きい）の場合や、B が前回の応答の boot と違う
+ * （その間にボードが再起動した）場合は、全状態のスナップショットを返す。
+ * クライアントは応答の seq と boot を次の since と boot に使う（boot を省略すると比べない）。
+ *   差分:   {"boot":7,"seq":42,"now":123456,"full":false,"changes":[{"seq":41,"t":123000,"room":"301","box":3,"action":"set"},...]}
+ *   全状態: {"boot":7,"seq":42,"now":123456,"full":true,"state":{"301":"0100...","302":"0000..."}}
+ * 全状態の文字列は区画番号順（n 文字目 = 区画 n、1=赤色）で、差分の box とそのまま対応する。
+ * box がない変更は全解除。クラスタの他ボードの部屋も同じ並びで含む。
+ */
+void sendChanges(WiFiClient &client, const char* path) {
+  long since = 0;
+  const char* sinceParam = strstr(path, "since=");
+  if (sinceParam != nullptr) {
+    since = atol(sinceParam + 6);
+  }
+  unsigned long boot = 0;
+  const char* bootParam = strstr(path, "boot=");
+  if (bootParam != nullptr) {
+    boot = strtoul(bootParam + 5, nullptr, 10);
+  }
+
+  unsigned long oldest = journalSeq - journalCount + 1; // 履歴に残っている最古のシーケンス番号
+  bool full = since < 0 || (unsigned long)since > journalSeq ||
+              (unsigned long)since + 1 < oldest || (boot != 0 && boot != bootId);
+
+  BufferedWriter out(client);
+  out.println("HTTP/1.1 200 OK");
+  out.println("Content-Type: application/json");
+  out.println("Access-Control-Allow-Origin: *");
+  out.println("Cache-Control: no-store");
+  out.println("Connection: close");
+  out.println();
+
+  char buf[96];
+  snprintf(buf, sizeof(buf), "{\"boot\":%lu,\"seq\":%lu,\"now\":%lu,\"full\":%s,",
+           (unsigned long)bootId, journalSeq, millis(), full ? "true" : "false");
+  out.print(buf);
+
+  if (full) {
+    out.print("\"state\":{");
+    // 担当する部屋（区画番号順）
+    for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+      snprintf(buf, sizeof(buf), "%s\"%d\":\"", i > 0 ? "," : "", LOCAL_ROOMS[i]);
+      out.print(buf);
+      uint16_t mask = localRoomMask(LOCAL_ROOMS[i]);
+      for (int b = 0; b < 16; b++) out.print((mask >> b) & 1 ? "1" : "0");
+      out.print("\"");
+    }
+    // クラスタの他ボードの部屋（区画番号順）
+    for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+      if (!cluster.rooms[r].used) continue;
+      snprintf(buf, sizeof(buf), ",\"%d\":\"", cluster.rooms[r].room);
+      out.print(buf);
+      for (int b = 0; b < 16; b++) out.print((cluster.rooms[r].mask >> b) & 1 ? "1" : "0");
+      out.print("\"");
+    }
+    out.println("}}");
+    out.flush();
+    return;
+  }
+
+  out.print("\"changes\":[");
+  bool first = true;
+  for (unsigned long seq = (unsigned long)since + 1; seq <= journalSeq; seq++) {
+    const JournalEntry &e = journal[(seq - 1) % JOURNAL_SIZE];
+    int len = snprintf(buf, sizeof(buf), "%s{\"seq\":%lu,\"t\":%lu,\"room\":\"%d\",",
+                       first ? "" : ",", e.seq, e.time, e.room);
+    if (e.box > 0) {
+      len += snprintf(buf + len, sizeof(buf) - len, "\"box\":%d,", e.box);
+    }
+    snprintf(buf + len, sizeof(buf) - len, "\"action\":\"%s\"}", e.set ? "set" : "clear");
+    out.print(buf);
+    first = false;
+  }
+  out.println("]}");
+  out.flush();
+}
+
+/**
+ * @brief 通知を WebSocket 用のキューと各通知先のキューに積む（送信は taskNotify() で行う）
+ * @param room 部屋番号 ("302" または "301")
+ * @param box 区画番号 (1-16、-1の場合は全解除)
+ * @param action アクション ("set" または "clear")
+ *
+ * WiFi 未接続の間もイベントを保持する。満杯の場合は最も古いイベントを破棄する。
+ * WebSocket クライアントが接続している間は、cctweaked_ip の通知先（wsReplaces）には積まない。
+ */
+void queueNotify(const char* room, int box, const char* action) {
+  NotifyEvent ev;
+  strncpy(ev.room, room, sizeof(ev.room) - 1);
+  ev.room[sizeof(ev.room) - 1] = '\0';
+  ev.box = box;
+  ev.set = (strcmp(action, "set") == 0);
+  ev.time = millis();
+
+  if (wsPushEnabled) {
+    if (notifyCount == NOTIFY_QUEUE_SIZE) {
+      // 満杯なので最も古いイベントを捨てる
+      notifyHead = (notifyHead + 1) % NOTIFY_QUEUE_SIZE;
+      notifyCount--;
+      notifyDropped++;
+    }
+    notifyQueue[(notifyHead + notifyCount) % NOTIFY_QUEUE_SIZE] = ev;
+    notifyCount++;
+  }
+
+  bool wsOpen = wsPushEnabled && wsOpenCount() > 0;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    Subscriber &sub = subscribers[i];
+    if (!sub.used) continue;
+    if (sub.wsReplaces && wsOpen) continue; // WebSocket で届く
+    if (sub.count == SUBSCRIBER_QUEUE_SIZE) {
+      sub.head = (sub.head + 1) % SUBSCRIBER_QUEUE_SIZE;
+      sub.count--;
+      sub.dropped++;
+      notifyDropped++;
+    }
+    sub.queue[(sub.head + sub.count) % SUBSCRIBER_QUEUE_SIZE] = ev;
+    sub.count++;
+  }
+}
+
+/**
+ * @brief WebSocket 用のキューを接続中の全クライアントへ流す（WiFi 接続中のみ呼ぶ）
+ */
+void drainNotifyQueue() {
+  if (notifyCount == 0) {
+    return;
+  }
+
+  if (wsOpenCount() == 0) {
+    // 受信している相手がいないので破棄する（WebSocket の接続時にはスナップショットを送る）
+    notifyHead = 0;
+    notifyCount = 0;
+    return;
+  }
+
+  while (notifyCount > 0) {
+    NotifyEvent &ev = notifyQueue[notifyHead];
+    if (!wsBroadcastEvent(ev.room, ev.box, ev.set)) {
+      break; // 全接続が切れた場合は残りを次回に回す
+    }
+    notifyHead = (notifyHead + 1) % NOTIFY_QUEUE_SIZE;
+    notifyCount--;
+  }
+}
+
+/**
+ * @brief 全キューで送信待ちになっているイベントの合計を返す
+ */
+int notifyPendingCount() {
+  int total = notifyCount;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    if (subscribers[i].used) total += subscribers[i].count;
+  }
+  return total;
+}
+
+/**
+ * @brief 最も溜まっているキューの溜まり具合を段数で返す（LED マトリクス表示用）
+ * @param levels 満杯のときの段数
+ * @return 0（空）〜 levels（満杯）
+ */
+int notifyQueueLevel(int levels) {
+  int level = (notifyCount * levels + NOTIFY_QUEUE_SIZE - 1) / NOTIFY_QUEUE_SIZE;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    const Subscriber &sub = subscribers[i];
+    if (!sub.used) continue;
+    int l = (sub.count * levels + SUBSCRIBER_QUEUE_SIZE - 1) / SUBSCRIBER_QUEUE_SIZE;
+    if (l > level) level = l;
+  }
+  return level;
+}
+
+// ============================================================
+// ★ 通知先（サブスクライバー）への配信と登録 API
+// ============================================================
+
+/**
+ * @brief 通知先を登録する（同じ宛先がすでにあればそれを返す）
+ * @param ip 通知先のIPアドレス
+ * @param port 通知先のポート
+ * @param path POST 先のパス
+ * @param persistent true なら EEPROM に保存する
+ * @param wsReplaces true なら WebSocket クライアントの接続中は POST を送らない
+ * @return 通知先の番号、空きがなければ -1
+ */
+int addSubscriber(const IPAddress &ip, uint16_t port, const char* path, bool persistent, bool wsReplaces) {
+  int freeSlot = -1;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    Subscriber &sub = subscribers[i];
+    if (sub.used && sub.ip == ip && sub.port == port && strcmp(sub.path, path) == 0) {
+      return i;
+    }
+    if (!sub.used && freeSlot == -1) freeSlot = i;
+  }
+  if (freeSlot == -1) return -1;
+
+  Subscriber &sub = subscribers[freeSlot];
+  sub.used = true;
+  sub.ip = ip;
+  sub.port = port;
+  strncpy(sub.path, path, SUBSCRIBER_PATH_MAX - 1);
+  sub.path[SUBSCRIBER_PATH_MAX - 1] = '\0';
+  sub.persistent = persistent;
+  sub.wsReplaces = wsReplaces;
+  sub.head = 0;
+  sub.count = 0;
+  sub.state = SUB_IDLE;
+  sub.nextAttempt = millis();
+  sub.backoff = 0;
+  sub.delivered = 0;
+  sub.failures = 0;
+  sub.dropped = 0;
+  sub.latencyLastMs = 0;
+  sub.latencyMaxMs = 0;
+  sub.latencySumMs = 0;
+  return freeSlot;
+}
+
+/**
+ * @brief 保存対象の通知先を EEPROM に書き込む
+ */
+void saveSubscribers() {
+  SubscriberStore store;
+  memset(&store, 0, sizeof(store));
+  store.magic = SUBSCRIBER_EEPROM_MAGIC;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    const Subscriber &sub = subscribers[i];
+    if (!sub.used || !sub.persistent) continue;
+    SubscriberRecord &rec = store.entries[store.count++];
+    for (int b = 0; b < 4; b++) rec.ip[b] = sub.ip[b];
+    rec.port = sub.port;
+    strncpy(rec.path, sub.path, SUBSCRIBER_PATH_MAX - 1);
+  }
+  EEPROM.put(SUBSCRIBER_EEPROM_ADDR, store);
+}
+
+/**
+ * @brief EEPROM に保存されている通知先を登録する（setup() で1回呼ぶ）
+ */
+void loadSubscribers() {
+  SubscriberStore store;
+  EEPROM.get(SUBSCRIBER_EEPROM_ADDR, store);
+  if (store.magic != SUBSCRIBER_EEPROM_MAGIC || store.count > SUBSCRIBER_MAX) {
+    return; // 未保存（または形式が違う）
+  }
+  for (int i = 0; i < store.count; i++) {
+    SubscriberRecord &rec = store.entries[i];
+    rec.path[SUBSCRIBER_PATH_MAX - 1] = '\0';
+    addSubscriber(IPAddress(rec.ip[0], rec.ip[1], rec.ip[2], rec.ip[3]), rec.port, rec.path, true, false);
+  }
+}
+
+/**
+ * @brief 通知先の送信に失敗したときの処理（接続を閉じて待ち時間を延ばす）
+ * @param sub 対象の通知先
+ * @param now 現在時刻 (millis)
+ *
+ * イベントはキューに残し、待ち時間の後に送り直す。
+ */
+void subscriberFailed(Subscriber &sub, unsigned long now) {
+  sub.client.stop();
+  sub.state = SUB_IDLE;
+  sub.failures++;
+  sub.backoff = (sub.backoff == 0) ? SUBSCRIBER_BACKOFF_MIN : sub.backoff * 2;
+  if (sub.backoff > SUBSCRIBER_BACKOFF_MAX) sub.backoff = SUBSCRIBER_BACKOFF_MAX;
+  sub.nextAttempt = now + sub.backoff;
+}
+
+/**
+ * @brief 通知先のキューの先頭のイベントを POST する（応答は待たない）
+ * @param sub 対象の通知先
+ * @param now 現在時刻 (millis)
+ */
+void subscriberSend(Subscriber &sub, unsigned long now) {
+  // 接続そのものは WiFiS3 ライブラリの中で完了まで待つため、失敗が続く相手は
+  // 待ち時間（backoff）を延ばして接続を試みる回数を減らす
+  if (!sub.client.connect(sub.ip, sub.port)) {
+    Log.print("Connection to subscriber failed: ");
+    Log.println(sub.ip);
+    subscriberFailed(sub, now);
+    // リンクが落ちていれば再接続を待つ
+    if (WiFi.status() != WL_CONNECTED) {
+      markLinkDown(now);
+    }
+    return;
+  }
+
+  // JSON ボディを構築
+  const NotifyEvent &ev = sub.queue[sub.head];
+  char jsonBody[64];
+  int jsonLen = snprintf(jsonBody, sizeof(jsonBody), "{\"room\":\"%s\",\"action\":\"%s\"",
+                         ev.room, ev.set ? "set" : "clear");
+  if (ev.box > 0) {
+    jsonLen += snprintf(jsonBody + jsonLen, sizeof(jsonBody) - jsonLen, ",\"box\":%d", ev.box);
+  }
+  snprintf(jsonBody + jsonLen, sizeof(jsonBody) - jsonLen, "}");
+
+  // HTTP POST リクエストを1回の書き込みで送信
+  char request[192];
+  int len = snprintf(request, sizeof(request),
+                     "POST %s HTTP/1.1\r\nHost: %d.%d.%d.%d\r\nContent-Type: application/json\r\n"
+                     "Content-Length: %d\r\nConnection: close\r\n\r\n%s\r\n",
+                     sub.path, sub.ip[0], sub.ip[1], sub.ip[2], sub.ip[3],
+                     (int)strlen(jsonBody), jsonBody);
+  sub.client.write((const uint8_t*)request, len);
+
+  Log.print("Sent to subscriber: ");
+  Log.println(jsonBody);
+
+  sub.state = SUB_WAITING;
+  sub.sentAt = now;
+  sub.statusLen = 0;
+}
+
+/**
+ * @brief 応答待ちの通知先の応答を確認する
+ * @param sub 対象の通知先
+ * @param now 現在時刻 (millis)
+ */
+void subscriberCheckResponse(Subscriber &sub, unsigned long now) {
+  // ステータス行（"HTTP/1.1 200 OK"）の先頭だけを見て、残りは捨てる
+  // 行が終わるか、相手が閉じるか、SUBSCRIBER_STATUS_LEN バイト揃うまで貯める
+  bool lineEnded = false;
+  while (sub.statusLen < SUBSCRIBER_STATUS_LEN && sub.client.available() > 0) {
+    char c = sub.client.read();
+    if (c == '\r' || c == '\n') {
+      lineEnded = true;
+      break;
+    }
+    sub.status[sub.statusLen++] = c;
+  }
+  bool closed = !sub.client.connected() && sub.client.available() == 0;
+  if (sub.statusLen > 0 && (sub.statusLen == SUBSCRIBER_STATUS_LEN || lineEnded || closed)) {
+    bool ok = (sub.statusLen >= 10 && memcmp(sub.status, "HTTP/1.", 7) == 0 && sub.status[9] == '2');
+    sub.client.stop();
+    sub.state = SUB_IDLE;
+
+    // エラー応答は送り直しても同じなので、成功・失敗どちらでもイベントは取り除く
+    const NotifyEvent &ev = sub.queue[sub.head];
+    if (ok) {
+      unsigned long latency = now - ev.time;
+      sub.delivered++;
+      sub.latencyLastMs = latency;
+      sub.latencySumMs += latency;
+      if (latency > sub.latencyMaxMs) sub.latencyMaxMs = latency;
+    } else {
+      sub.failures++;
+      Log.print("Subscriber returned error: ");
+      Log.println(sub.ip);
+    }
+    sub.head = (sub.head + 1) % SUBSCRIBER_QUEUE_SIZE;
+    sub.count--;
+    sub.backoff = 0;
+    sub.nextAttempt = now;
+    return;
+  }
+
+  if (now - sub.sentAt > SUBSCRIBER_TIMEOUT) {
+    Log.print("Subscriber timeout: ");
+    Log.println(sub.ip);
+    subscriberFailed(sub, now);
+  }
+}
+
+/**
+ * @brief 各通知先の配信を進める（WiFi 接続中のみ呼ぶ）
+ *
+ * 応答待ちの通知先は応答を確認するだけで、待たずに次へ進む。
+ * 新しい接続は1回の呼び出しにつき1件まで（接続はブロックするため）とし、通知先を順番に回る。
+ * WebSocket クライアントの接続中は、wsReplaces の通知先の未送信分を捨てる。
+ */
+void pollSubscribers() {
+  unsigned long now = millis();
+  bool wsOpen = wsPushEnabled && wsOpenCount() > 0;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    Subscriber &sub = subscribers[i];
+    if (sub.used && sub.state == SUB_WAITING) {
+      subscriberCheckResponse(sub, now);
+    }
+    if (sub.used && sub.wsReplaces && wsOpen && sub.state == SUB_IDLE) {
+      // WebSocket の接続時にスナップショットを送っているので、未送信の分は不要
+      sub.head = 0;
+      sub.count = 0;
+    }
+  }
+
+  for (int n = 0; n < SUBSCRIBER_MAX; n++) {
+    int i = (subscriberNextStart + n) % SUBSCRIBER_MAX;
+    Subscriber &sub = subscribers[i];
+    if (!sub.used || sub.state != SUB_IDLE || sub.count == 0) continue;
+    if ((long)(now - sub.nextAttempt) < 0) continue;
+
+    subscriberSend(sub, now);
+    subscriberNextStart = (i + 1) % SUBSCRIBER_MAX;
+    break;
+  }
+}
+
+/**
+ * @brief GET /api/subscribers に応答する（登録済みの通知先と配信の状況）
+ * @param client 応答先のクライアント
+ *
+ * 応答例:
+ * {"subscribers":[{"id":0,"ip":"192.168.1.100","port":8080,"path":"/api/box","persistent":true,"wsReplaces":false,
+ *  "queued":0,"delivered":12,"failures":1,"dropped":0,"backoffMs":0,
+ *  "latencyMs":{"last":35,"avg":40,"max":1210}}]}
+ */
+void sendSubscribers(WiFiClient &client) {
+  BufferedWriter out(client);
+  out.println("HTTP/1.1 200 OK");
+  out.println("Content-Type: application/json");
+  out.println("Access-Control-Allow-Origin: *");
+  out.println("Cache-Control: no-store");
+  out.println("Connection: close");
+  out.println();
+
+  out.print("{\"subscribers\":[");
+  char buf[160]; // 1件を3回に分けて書く（パスが最長でも収まるように）
+  bool first = true;
+  for (int i = 0; i < SUBSCRIBER_MAX; i++) {
+    const Subscriber &sub = subscribers[i];
+    if (!sub.used) continue;
+    snprintf(buf, sizeof(buf),
+             "%s{\"id\":%d,\"ip\":\"%d.%d.%d.%d\",\"port\":%u,\"path\":\"%s\",\"persistent\":%s,\"wsReplaces\":%s,",
+             first ? "" : ",", i, sub.ip[0], sub.ip[1], sub.ip[2], sub.ip[3], sub.port, sub.path,
+             sub.persistent ? "true" : "false", sub.wsReplaces ? "true" : "false");
+    out.print(buf);
+    snprintf(buf, sizeof(buf),
+             "\"queued\":%d,\"delivered\":%lu,\"failures\":%lu,\"dropped\":%lu,\"backoffMs\":%lu,",
+             sub.count, sub.delivered, sub.failures, sub.dropped, sub.backoff);
+    out.print(buf);
+    snprintf(buf, sizeof(buf), "\"latencyMs\":{\"last\":%lu,\"avg\":%lu,\"max\":%lu}}",
+             sub.latencyLastMs, sub.delivered ? sub.latencySumMs / sub.delivered : 0,
+             sub.latencyMaxMs);
+    out.print(buf);
+    first = false;
+  }
+  out.println("]}");
+  out.flush();
+}
+
+/**
+ * @brief 通知先の登録・削除の結果を返す
+ * @param client 応答先のクライアント
+ * @param statusLine ステータス行（例: "HTTP/1.1 201 Created"）
+ * @param json 応答のボディ（nullptr ならボディなし）
+ */
+void sendSubscriberResult(WiFiClient &client, const char* statusLine, const char* json) {
+  client.println(statusLine);
+  if (json != nullptr) client.println("Content-Type: application/json");
+  client.println("Access-Control-Allow-Origin: *");
+  client.println("Connection: close");
+  client.println();
+  if (json != nullptr) client.println(json);
+}
+
+/**
+ * @brief 通知先の登録・削除を許可するか確かめ、許可しない場合は応答まで返す
+ * @param client 応答先のクライアント
+ * @param token X-Admin-Token ヘッダーの値
+ * @return true: 許可する
+ */
+bool adminAuthorized(WiFiClient &client, const char* token) {
+  if (ADMIN_TOKEN[0] == '\0') {
+    sendSubscriberResult(client, "HTTP/1.1 403 Forbidden", "{\"error\":\"admin token not configured\"}");
+    return false;
+  }
+  // 一致した文字数で応答時間が変わらないよう、途中で打ち切らずに比べる
+  size_t len = strlen(ADMIN_TOKEN);
+  uint8_t diff = strlen(token) != len;
+  for (size_t i = 0; i < len && token[i] != '\0'; i++) {
+    diff |= token[i] ^ ADMIN_TOKEN[i];
+  }
+  if (diff != 0) {
+    Log.print("Subscriber change refused: ");
+    Log.println(client.remoteIP());
+    sendSubscriberResult(client, "HTTP/1.1 401 Unauthorized", "{\"error\":\"unauthorized\"}");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief POST /api/subscribers で通知先を登録する
+ * @param client 応答先のクライアント
+ * @param body {"ip":"192.168.1.100","port":8080,"path":"/api/box"}（port と path は省略可）
+ */
+void handleSubscriberPost(WiFiClient &client, const char* body) {
+  char value[SUBSCRIBER_PATH_MAX];
+  IPAddress ip;
+  if (!jsonField(body, "ip", value, sizeof(value)) || !ip.fromString(value) ||
+      ip == IPAddress(0, 0, 0, 0)) {
+    sendSubscriberResult(client, "HTTP/1.1 400 Bad Request", "{\"error\":\"invalid ip\"}");
+    return;
+  }
+
+  long port = 8080;
+  if (jsonField(body, "port", value, sizeof(value))) {
+    port = atol(value);
+  }
+  if (port <= 0 || port > 65535) {
+    sendSubscriberResult(client, "HTTP/1.1 400 Bad Request", "{\"error\":\"invalid port\"}");
+    return;
+  }
+
+  char path[SUBSCRIBER_PATH_MAX];
+  if (!jsonField(body, "path", path, sizeof(path)) || path[0] == '\0') {
+    strcpy(path, "/api/box");
+  }
+  if (path[0] != '/' || strchr(path, ' ') != nullptr) {
+    sendSubscriberResult(client, "HTTP/1.1 400 Bad Request", "{\"error\":\"invalid path\"}");
+    return;
+  }
+
+  int id = addSubscriber(ip, (uint16_t)port, path, true, false);
+  if (id == -1) {
+    sendSubscriberResult(client, "HTTP/1.1 409 Conflict", "{\"error\":\"full\"}");
+    return;
+  }
+  // 同じ宛先が cctweaked_ip から作られていた場合も、以後は保存対象にする
+  subscribers[id].persistent = true;
+  saveSubscribers();
+
+  Log.print("Subscriber added: ");
+  Log.println(ip);
+
+  char json[24];
+  snprintf(json, sizeof(json), "{\"id\":%d}", id);
+  sendSubscriberResult(client, "HTTP/1.1 201 Created", json);
+}
+
+/**
+ * @brief DELETE /api/subscribers/<id>（または ?id=<id>）で通知先を削除する
+ * @param client 応答先のクライアント
+ * @param path リクエストのパス
+ */
+void handleSubscriberDelete(WiFiClient &client, const char* path) {
+  const char* idStr = strstr(path, "id=");
+  if (idStr != nullptr) {
+    idStr += 3;
+  } else if (path[16] == '/') {
+    idStr = path + 17;
+  }
+  int id = (idStr != nullptr && *idStr >= '0' && *idStr <= '9') ? atoi(idStr) : -1;
+  if (id < 0 || id >= SUBSCRIBER_MAX || !subscribers[id].used) {
+    sendSubscriberResult(client, "HTTP/1.1 404 Not Found", "{\"error\":\"not found\"}");
+    return;
+  }
+
+  Subscriber &sub = subscribers[id];
+  sub.client.stop();
+  sub.used = false;
+  sub.state = SUB_IDLE;
+  sub.count = 0;
+  saveSubscribers();
+
+  Log.print("Subscriber removed: ");
+  Log.println(sub.ip);
+  sendSubscriberResult(client, "HTTP/1.1 204 No Content", nullptr);
+}
+// ============================================================
+// ★ LED マトリクスの状態表示
+// ============================================================
+
+/**
+ * @brief 部屋の区画を 4×4 のブロックとしてフレームに描く
+ * @param left 先頭列
+ * @param mask 区画番号順のビットマスク（bit n-1 = 区画n）
+ */
+void drawMatrixRoom(int left, uint16_t mask) {
+  for (int box = 1; box <= 16; box++) {
+    int row = MATRIX_ROOM_TOP + (box - 1) / 4;
+    int col = left + (box - 1) % 4;
+    matrixFrame[row][col] = (mask >> (box - 1)) & 1;
+  }
+}
+
+/**
+ * @brief 状態が変わっていれば LED マトリクスを描き直す
+ * 状態・リンク・キューの段数を前回の表示と比べ、どれも同じなら何もしない
+ */
+void updateMatrix() {
+  bool link = (wifiState == WIFI_STATE_CONNECTED);
+  int queue = notifyQueueLevel(MATRIX_QUEUE_LEVELS);
+  if (matrixDrawn && localChangeSeq == matrixShownSeq &&
+      link == matrixShownLink && queue == matrixShownQueue) {
+    return;
+  }
+
+  memset(matrixFrame, 0, sizeof(matrixFrame));
+  drawMatrixRoom(MATRIX_ROOM301_LEFT, localRoomMask(301));
+  drawMatrixRoom(MATRIX_ROOM302_LEFT, localRoomMask(302));
+  matrixFrame[0][MATRIX_STATUS_COL] = link ? 1 : 0;
+  for (int i = 0; i < queue; i++) {
+    matrixFrame[MATRIX_ROWS - 1 - i][MATRIX_STATUS_COL] = 1;
+  }
+  matrix.renderBitmap(matrixFrame, MATRIX_ROWS, MATRIX_COLS);
+
+  matrixDrawn = true;
+  matrixShownSeq = localChangeSeq;
+  matrixShownLink = link;
+  matrixShownQueue = queue;
+  matrixRedraws++;
+}
+
+// ============================================================
+// ★ WebSocket プッシュ（RFC 6455 の最小実装: サーバー→クライアントのテキストフレーム）
+// ============================================================
+
+/**
+ * @brief SHA-1 ハッシュを計算（WebSocket ハンドシェイク専用）
+ * @param data 入力データ
+ * @param len 入力データ長
+ * @param out 20バイトの出力先
+ */
+void sha1(const uint8_t* data, size_t len, uint8_t out[20]) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint8_t block[64];
+  size_t total = len + 9;                    // データ + 0x80 + 64bit長
+  size_t blocks = (total + 63) / 64;
+
+  for (size_t b = 0; b < blocks; b++) {
+    // パディングを含めたブロックを組み立てる
+    for (int i = 0; i < 64; i++) {
+      size_t pos = b * 64 + i;
+      if (pos < len) {
+        block[i] = data[pos];
+      } else if (pos == len) {
+        block[i] = 0x80;
+      } else if (pos >= blocks * 64 - 8) {
+        uint64_t bits = (uint64_t)len * 8;
+        block[i] = (uint8_t)(bits >> (8 * (blocks * 64 - 1 - pos)));
+      } else {
+        block[i] = 0;
+      }
+    }
+
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+             ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+      uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = (x << 1) | (x >> 31);
+    }
+
+    uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20)      { f = (bb & c) | (~bb & d);          k = 0x5A827999; }
+      else if (i < 40) { f = bb ^ c ^ d;                    k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (bb & c) | (bb & d) | (c & d); k = 0x8F1BBCDC; }
+      else             { f = bb ^ c ^ d;                    k = 0xCA62C1D6; }
+      uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = (bb << 30) | (bb >> 2);
+      bb = a;
+      a = t;
+    }
+    h[0] += a; h[1] += bb; h[2] += c; h[3] += d; h[4] += e;
+  }
+
+  for (int i = 0; i < 5; i++) {
+    out[i * 4]     = (uint8_t)(h[i] >> 24);
+    out[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+    out[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+    out[i * 4 + 3] = (uint8_t)h[i];
+  }
+}
+
+/**
+ * @brief Base64 エンコード
+ * @param data 入力データ
+ * @param len 入力データ長
+ * @param out 出力先（((len + 2) / 3) * 4 + 1 バイト以上）
+ */
+void base64Encode(const uint8_t* data, size_t len, char* out) {
+  static const char TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < len) v |= data[i + 2];
+    out[o++] = TABLE[(v >> 18) & 0x3F];
+    out[o++] = TABLE[(v >> 12) & 0x3F];
+    out[o++] = (i + 1 < len) ? TABLE[(v >> 6) & 0x3F] : '=';
+    out[o++] = (i + 2 < len) ? TABLE[v & 0x3F] : '=';
+  }
+  out[o] = '\0';
+}
+
+/**
+ * @brief 確立済みの WebSocket 接続数を返す
+ */
+int wsOpenCount() {
+  int n = 0;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsClients[i].state == WS_OPEN) n++;
+  }
+  return n;
+}
+
+/**
+ * @brief 1つの WebSocket 接続にフレームを送信（サーバー側なのでマスクしない）
+ * @param ws 送信先
+ * @param opcode 0x1: テキスト, 0x8: クローズ, 0xA: ポン
+ * @param payload ペイロード（125バイト以下）
+ * @param len ペイロード長
+ * @return true: 送信成功
+ */
+bool wsSendFrame(WsClient &ws, uint8_t opcode, const char* payload, size_t len) {
+  if (len > 125) len = 125; // 状態通知は短いので拡張長は使わない
+  uint8_t frame[2 + 125];
+  frame[0] = 0x80 | opcode; // FIN + opcode
+  frame[1] = (uint8_t)len;
+  memcpy(frame + 2, payload, len);
+  if (ws.client.write(frame, 2 + len) != 2 + len) {
+    ws.client.stop();
+    ws.state = WS_FREE;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief 状態変化を全 WebSocket 接続に送信
+ * @param room 部屋番号 ("302" または "301")
+ * @param box 区画番号 (1-16、-1の場合は全解除)
+ * @param set true: "set", false: "clear"
+ * @return true: 1つ以上の接続に送信できた
+ */
+bool wsBroadcastEvent(const char* room, int box, bool set) {
+  // subscriberSend() の POST ボディと同じ形式
+  char msg[64];
+  int len;
+  if (box > 0) {
+    len = snprintf(msg, sizeof(msg), "{\"room\":\"%s\",\"action\":\"%s\",\"box\":%d}",
+                   room, set ? "set" : "clear", box);
+  } else {
+    len = snprintf(msg, sizeof(msg), "{\"room\":\"%s\",\"action\":\"%s\"}",
+                   room, set ? "set" : "clear");
+  }
+
+  bool sent = false;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsClients[i].state == WS_OPEN && wsSendFrame(wsClients[i], 0x1, msg, len)) {
+      sent = true;
+    }
+  }
+  return sent;
+}
+
+/**
+ * @brief 接続直後の WebSocket クライアントに現在の全状態を送信
+ * @param ws 送信先
+ *
+ * 形式: {"type":"snapshot","301":"0100...","302":"0000..."}
+ * 区画番号順（n 文字目 = 区画 n、1=赤色）で、イベントの box とそのまま対応する。
+ */
+void wsSendSnapshot(WsClient &ws) {
+  char msg[80];
+  int len = snprintf(msg, sizeof(msg), "{\"type\":\"snapshot\"");
+  for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+    len += snprintf(msg + len, sizeof(msg) - len, ",\"%d\":\"", LOCAL_ROOMS[i]);
+    uint16_t mask = localRoomMask(LOCAL_ROOMS[i]);
+    for (int b = 0; b < 16; b++) msg[len++] = (mask >> b) & 1 ? '1' : '0';
+    msg[len++] = '"';
+  }
+  len += snprintf(msg + len, sizeof(msg) - len, "}");
+  wsSendFrame(ws, 0x1, msg, len);
+}
+
+/**
+ * @brief ハンドシェイク要求を読み進め、完了したら 101 応答を返す
+ * @param ws 対象の接続
+ */
+void wsReadHandshake(WsClient &ws) {
+  while (ws.client.available()) {
+    char c = ws.client.read();
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (ws.lineLen < (int)sizeof(ws.line) - 1) ws.line[ws.lineLen++] = c;
+      continue;
+    }
+
+    ws.line[ws.lineLen] = '\0';
+    if (ws.lineLen == 0) {
+      // 空行 = ヘッダー終わり
+      if (ws.key[0] == '\0') {
+        ws.client.println("HTTP/1.1 400 Bad Request");
+        ws.client.println("Connection: close");
+        ws.client.println();
+        ws.client.stop();
+        ws.state = WS_FREE;
+        return;
+      }
+
+      // Sec-WebSocket-Accept = base64(sha1(key + GUID))
+      char buf[32 + 36 + 1];
+      snprintf(buf, sizeof(buf), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", ws.key);
+      uint8_t digest[20];
+      sha1((const uint8_t*)buf, strlen(buf), digest);
+      char accept[29];
+      base64Encode(digest, 20, accept);
+
+      ws.client.println("HTTP/1.1 101 Switching Protocols");
+      ws.client.println("Upgrade: websocket");
+      ws.client.println("Connection: Upgrade");
+      ws.client.print("Sec-WebSocket-Accept: ");
+      ws.client.println(accept);
+      ws.client.println();
+
+      ws.state = WS_OPEN;
+      ws.since = millis();
+      Log.println("WebSocket client connected");
+      wsSendSnapshot(ws);
+      return;
+    }
+
+    // ヘッダー名は大文字小文字を区別しない
+    if (strncasecmp(ws.line, "Sec-WebSocket-Key:", 18) == 0) {
+      const char* v = ws.line + 18;
+      while (*v == ' ') v++;
+      strncpy(ws.key, v, sizeof(ws.key) - 1);
+      ws.key[sizeof(ws.key) - 1] = '\0';
+    }
+    ws.lineLen = 0;
+  }
+}
+
+/**
+ * @brief 確立済みの接続から届いたフレームを処理（ping/close のみ対応、その他は読み捨て）
+ * @param ws 対象の接続
+ */
+void wsReadFrames(WsClient &ws) {
+  // クライアント→サーバーのフレームは必ずマスクされている（ヘッダー2 + マスク4バイト）
+  while (ws.state == WS_OPEN && ws.client.available() >= 6) {
+    uint8_t b0 = ws.client.read();
+    uint8_t b1 = ws.client.read();
+    uint8_t opcode = b0 & 0x0F;
+    size_t len = b1 & 0x7F;
+    if (len >= 126) {
+      // 制御用の短いフレーム以外は想定しないので切断する
+      ws.client.stop();
+      ws.state = WS_FREE;
+      return;
+    }
+
+    uint8_t mask[4];
+    for (int i = 0; i < 4; i++) mask[i] = ws.client.read();
+
+    char payload[125];
+    unsigned long start = millis();
+    for (size_t i = 0; i < len; i++) {
+      while (!ws.client.available()) {
+        if (millis() - start > 100) {
+          ws.client.stop();
+          ws.state = WS_FREE;
+          return;
+        }
+        schedulerYield();
+      }
+      payload[i] = ws.client.read() ^ mask[i % 4];
+    }
+
+    if (opcode == 0x8) {
+      // クローズ: 応答して切断
+      wsSendFrame(ws, 0x8, payload, len < 2 ? len : 2);
+      ws.client.stop();
+      ws.state = WS_FREE;
+      Log.println("WebSocket client closed");
+    } else if (opcode == 0x9) {
+      // ping には pong を返す
+      wsSendFrame(ws, 0xA, payload, len);
+    }
+  }
+}
+
+/**
+ * @brief WebSocket サーバーの処理（新規接続の受付・ハンドシェイク・受信フレーム・切断検出）
+ */
+void pollWebSocket() {
+  WiFiClient incoming = wsServer.available();
+  if (incoming) {
+    // available() は確立済みの接続も返すので、既存の接続かどうかを確認する
+    bool known = false;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (wsClients[i].state != WS_FREE && wsClients[i].client == incoming) {
+        known = true;
+        break;
+      }
+    }
+    if (!known) {
+      int slot = -1;
+      for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (wsClients[i].state == WS_FREE) {
+          slot = i;
+          break;
+        }
+      }
+      if (slot == -1) {
+        // 空きがない
+        incoming.println("HTTP/1.1 503 Service Unavailable");
+        incoming.println("Connection: close");
+        incoming.println();
+        incoming.stop();
+      } else {
+        WsClient &ws = wsClients[slot];
+        ws.client = incoming;
+        ws.state = WS_HANDSHAKE;
+        ws.since = millis();
+        ws.lineLen = 0;
+        ws.key[0] = '\0';
+      }
+    }
+  }
+
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    WsClient &ws = wsClients[i];
+    if (ws.state == WS_FREE) continue;
+
+    if (!ws.client.connected()) {
+      ws.client.stop();
+      ws.state = WS_FREE;
+      Log.println("WebSocket client disconnected");
+      continue;
+    }
+
+    if (ws.state == WS_HANDSHAKE) {
+      wsReadHandshake(ws);
+      if (ws.state == WS_HANDSHAKE && millis() - ws.since > WS_HANDSHAKE_TIMEOUT) {
+        ws.client.stop();
+        ws.state = WS_FREE;
+      }
+    } else {
+      wsReadFrames(ws);
+    }
+  }
+}
+
+// ============================================================
+// ★ 複数ボードのクラスタ（UDP による状態の複製）
+// ============================================================
+
+/**
+ * @brief 担当する部屋の状態を区画番号順のビットマスクにする
+ * @param room 部屋番号 (301 / 302)
+ * @return bit (n-1) = 区画 n がハイライト
+ */
+uint16_t localRoomMask(int room) {
+  const int* newToOld = (room == 301) ? ROOM301_NEW_TO_OLD : ROOM302_NEW_TO_OLD;
+  const bool* state = (room == 301) ? box301State : box302State;
+  uint16_t mask = 0;
+  for (int box = 1; box <= 16; box++) {
+    int oldIdx = newToOld[box];
+    if (oldIdx != -1 && state[oldIdx]) mask |= (uint16_t)1 << (box - 1);
+  }
+  return mask;
+}
+
+/**
+ * @brief 全ピアに同じパケットを送信する
+ */
+void clusterSendToPeers(const uint8_t* buf, size_t len) {
+  for (int i = 0; i < CLUSTER_PEER_COUNT; i++) {
+    clusterUdp.beginPacket(clusterPeers[i], CLUSTER_PORT);
+    clusterUdp.write(buf, len);
+    clusterUdp.endPacket();
+  }
+}
+
+/**
+ * @brief 知っている全部屋（担当する部屋 + 他ボードの部屋）の状態をピアへ送る
+ */
+void clusterSendState() {
+  uint16_t masks[LOCAL_ROOM_COUNT];
+  for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+    masks[i] = localRoomMask(LOCAL_ROOMS[i]);
+  }
+  uint8_t buf[CLUSTER_HEADER_SIZE + (LOCAL_ROOM_COUNT + CLUSTER_MAX_ROOMS) * CLUSTER_ENTRY_SIZE];
+  size_t len = clusterEncodeState(cluster, masks, buf);
+  clusterSendToPeers(buf, len);
+}
+
+/**
+ * @brief 他ボードの部屋の区画の変化を変更履歴に記録する（通知は担当ボードが行う）
+ */
+void clusterRecordChange(int room, int box, bool set) {
+  if (box == -1) {
+    Log.print("Cluster room expired: ");
+    Log.println(room);
+  }
+  journalAppend(room, box, set);
+}
+
+/**
+ * @brief 他の部屋へのコマンドを担当ボードへ転送する（担当ボード以外は無視する）
+ * @param room 部屋番号
+ * @param box 区画番号 (1-16、それ以外は全解除)
+ * @param action "set" または "clear"
+ * @return true: 送信した
+ */
+bool clusterForwardCommand(const char* room, int box, const char* action) {
+  int roomNum = atoi(room);
+  bool set = strcmp(action, "set") == 0;
+  if (roomNum <= 0 || (!set && strcmp(action, "clear") != 0)) {
+    return false;
+  }
+
+  uint8_t buf[CLUSTER_HEADER_SIZE + CLUSTER_COMMAND_SIZE];
+  clusterHeader(buf, CLUSTER_MSG_COMMAND, CLUSTER_NODE_ID, 1);
+  putU16(buf + CLUSTER_HEADER_SIZE, roomNum);
+  buf[CLUSTER_HEADER_SIZE + 2] = (box >= 1 && box <= 16) ? box : 0;
+  buf[CLUSTER_HEADER_SIZE + 3] = set ? 1 : 0;
+  clusterSendToPeers(buf, sizeof(buf));
+
+  Log.print("Forwarded command for room ");
+  Log.print(roomNum);
+  Log.println(" to cluster peers");
+  return true;
+}
+
+/**
+ * @brief 受信した転送コマンドを、自分が担当する部屋なら POST と同じ処理で反映する
+ */
+void clusterApplyCommand(const uint8_t* p) {
+  int room = getU16(p);
+  int box = p[2];
+  bool set = p[3] == 1;
+
+  for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+    if (LOCAL_ROOMS[i] != room) continue;
+
+    char body[64];
+    if (box > 0) {
+      snprintf(body, sizeof(body), "{\"room\":\"%d\",\"box\":%d,\"action\":\"%s\"}",
+               room, box, set ? "set" : "clear");
+    } else {
+      snprintf(body, sizeof(body), "{\"room\":\"%d\",\"action\":\"%s\"}",
+               room, set ? "set" : "clear");
+    }
+    applyCommand(body);
+    return;
+  }
+}
+
+/**
+ * @brief クラスタの受信処理と定期送信（cluster タスクから呼ぶ）
+ */
+void pollCluster() {
+  // 受信（1回の呼び出しで最大4パケット）
+  for (int n = 0; n < 4; n++) {
+    int size = clusterUdp.parsePacket();
+    if (size <= 0) break;
+
+    uint8_t buf[CLUSTER_HEADER_SIZE + (LOCAL_ROOM_COUNT + CLUSTER_MAX_ROOMS) * CLUSTER_ENTRY_SIZE];
+    int len = clusterUdp.read(buf, sizeof(buf));
+    uint8_t type, sender;
+    int count;
+    if (!clusterParseHeader(buf, len, type, sender, count) || sender == CLUSTER_NODE_ID) {
+      continue; // 形式が違う、または自分が送ったもの
+    }
+
+    if (type == CLUSTER_MSG_STATE) {
+      clusterMergeState(cluster, buf, len, millis(), clusterRecordChange);
+    } else if (type == CLUSTER_MSG_COMMAND && len >= CLUSTER_HEADER_SIZE + CLUSTER_COMMAND_SIZE) {
+      clusterApplyCommand(buf + CLUSTER_HEADER_SIZE);
+    }
+  }
+
+  // 変化があればすぐに、なければ一定間隔で全状態を送る
+  unsigned long now = millis();
+  if (cluster.dirty || (long)(now - clusterNextSync) >= 0) {
+    clusterExpireRooms(cluster, now, CLUSTER_ROOM_TIMEOUT, clusterRecordChange);
+    clusterSendState();
+    cluster.dirty = false;
+    clusterNextSync = now + CLUSTER_SYNC_INTERVAL;
+  }
+}
+
+// ============================================================
+// ★ 状態のアナウンス（UDP ブロードキャスト / マルチキャスト）
+// ============================================================
+
+/**
+ * @brief アナウンスの宛先を返す（マルチキャストのグループ、なければサブネットのブロードキャスト）
+ */
+IPAddress announceAddress() {
+  if (announceGroup != IPAddress(0, 0, 0, 0)) {
+    return announceGroup;
+  }
+  IPAddress ip = WiFi.localIP();
+  IPAddress mask = WiFi.subnetMask();
+  return IPAddress(ip[0] | (uint8_t)~mask[0], ip[1] | (uint8_t)~mask[1],
+                   ip[2] | (uint8_t)~mask[2], ip[3] | (uint8_t)~mask[3]);
+}
+
+/**
+ * @brief 担当する部屋の状態を1パケットで送信する
+ */
+void announceState() {
+  uint8_t buf[ANNOUNCE_HEADER_SIZE + LOCAL_ROOM_COUNT * ANNOUNCE_ENTRY_SIZE];
+  buf[0] = 'M';
+  buf[1] = 'D';
+  buf[2] = 'A';
+  buf[3] = 1;
+  buf[4] = CLUSTER_NODE_ID;
+  putU32(buf + 5, localChangeSeq);
+  buf[9] = LOCAL_ROOM_COUNT;
+  uint8_t* p = buf + ANNOUNCE_HEADER_SIZE;
+  for (int i = 0; i < LOCAL_ROOM_COUNT; i++) {
+    putU16(p, LOCAL_ROOMS[i]);
+    putU16(p + 2, localRoomMask(LOCAL_ROOMS[i]));
+    p += ANNOUNCE_ENTRY_SIZE;
+  }
+
+  announceUdp.beginPacket(announceAddress(), ANNOUNCE_PORT);
+  announceUdp.write(buf, sizeof(buf));
+  announceUdp.endPacket();
+  announceSent++;
+}
+
+/**
+ * @brief 状態が変わっていればすぐに、変わっていなくても一定間隔でアナウンスする
+ * 変化の検出は localChangeSeq で行うので、短時間に続いた変化は1パケットにまとまり、
+ * パケットに含まないクラスタの他ボードの部屋の変化では送らない
+ */
+void pollAnnounce() {
+  unsigned long now = millis();
+  if (localChangeSeq != announceSeq || (long)(now - announceNext) >= 0) {
+    announceSeq = localChangeSeq;
+    announceState();
+    announceNext = now + ANNOUNCE_INTERVAL;
+  }
+}
@@ -50,17 +50,10 @@ const char STYLE_CSS[] PROGMEM = R"rawliteral(
     justify-items: center;
     padding-top: 40px; /* 部屋名との間隔 */
   }
-  /* 2-301 は 3列グリッド */
-  .room-301 .grid-container {
-    grid-template-columns: repeat(3, 1fr); 
-  }
-  /* 2-302 は 5列グリッド */
-  .room-302 .grid-container {
-    grid-template-columns: repeat(5, 1fr); 
-  }
+  /* 列数 (grid-template-columns) と四角の幅 (--w) は部屋ごとにレイアウト表から出力する */
   
   .grid-item {
-    width: 80px; /* 四角のサイズ (幅) */
+    width: var(--w, 80px); /* 四角のサイズ (幅) */
     height: 50px; /* 四角のサイズ (高さ) */
     border: 1px solid black;
     background-color: #eee;
@@ -71,68 +64,11 @@ const char STYLE_CSS[] PROGMEM = R"rawliteral(
     font-size: 1.2em;
     color: #333;
   }
-  /* 5列グリッド用に幅を調整 */
-  .room-302 .grid-item {
-    width: 60px; 
-  }
-  
   .highlighted {
     background-color: #ffcccc; /* ハイライト色 (薄い赤) */
     border: 1px solid red;
     color: #cc0000; /* ハイライト時の文字色 */
   }
-
-  /* 2-301 の配置 (3列グリッド) (grid-area: row-start / col-start / row-end / col-end) */
-  .room-301 .grid-item:nth-child(1) { grid-area: 1 / 1 / 2 / 2; }
-  .room-301 .grid-item:nth-child(2) { grid-area: 2 / 1 / 3 / 2; }
-  .room-301 .grid-item:nth-child(3) { grid-area: 3 / 1 / 4 / 2; } /* 左3 (ハイライト) */
-  .room-301 .grid-item:nth-child(4) { grid-area: 4 / 1 / 5 / 2; }
-  .room-301 .grid-item:nth-child(5) { grid-area: 5 / 1 / 6 / 2; }
-  .room-301 .grid-item:nth-child(6) { grid-area: 7 / 1 / 8 / 2; } /* 左下1 */
-  .room-301 .grid-item:nth-child(7) { grid-area: 8 / 1 / 9 / 2; } /* 左下2 */
-
-  .room-301 .grid-item:nth-child(8) { grid-area: 2 / 2 / 3 / 3; } /* 中央1 */
-  .room-301 .grid-item:nth-child(9) { grid-area: 4 / 2 / 5 / 3; } /* 中央2 */
-
-  .room-301 .grid-item:nth-child(10) { grid-area: 1 / 3 / 2 / 4; }
-  .room-301 .grid-item:nth-child(11) { grid-area: 2 / 3 / 3 / 4; }
-  .room-301 .grid-item:nth-child(12) { grid-area: 3 / 3 / 4 / 4; }
-  .room-301 .grid-item:nth-child(13) { grid-area: 4 / 3 / 5 / 4; } /* 右4 (ハイライト) */
-  .room-301 .grid-item:nth-child(14) { grid-area: 5 / 3 / 6 / 4; } /* 右5 */
-  .room-301 .grid-item:nth-child(15) { grid-area: 7 / 3 / 8 / 4; } /* 右下1 */
-  .room-301 .grid-item:nth-child(16) { grid-area: 8 / 3 / 9 / 4; } /* 右下2 */
-
-
-  /* 2-302 の配置 (5列グリッド) */
-  /* 左列（Col 1、上から下）: 1, 2, ▫️, 3, ▫️, ▫️, ▫️ */
-  .room-302 .grid-item:nth-child(1) { grid-area: 1 / 1 / 2 / 2; } /* Row 1: 1 */
-  .room-302 .grid-item:nth-child(2) { grid-area: 2 / 1 / 3 / 2; } /* Row 2: 2 */
-  .room-302 .grid-item:nth-child(3) { grid-area: 3 / 1 / 4 / 2; } /* Row 3: ▫️ */
-  .room-302 .grid-item:nth-child(4) { grid-area: 4 / 1 / 5 / 2; } /* Row 4: 3 */
-  .room-302 .grid-item:nth-child(5) { grid-area: 5 / 1 / 6 / 2; } /* Row 5: ▫️ */
-  .room-302 .grid-item:nth-child(6) { grid-area: 6 / 1 / 7 / 2; } /* Row 6: ▫️ */
-  .room-302 .grid-item:nth-child(7) { grid-area: 7 / 1 / 8 / 2; } /* Row 7: ▫️ */
-  
-  /* Col 2（上から下）: なし, なし, なし, なし, なし, なし, ▫️ */
-  .room-302 .grid-item:nth-child(8) { grid-area: 7 / 2 / 8 / 3; } /* Row 7: ▫️ */
-  
-  /* 中央列（Col 3、上から下）: 空白, なし, ▫️, なし, なし, なし, 4 */
-  .room-302 .grid-item:nth-child(9) { grid-area: 1 / 3 / 2 / 4; } /* Row 1: 空白 */
-  .room-302 .grid-item:nth-child(10) { grid-area: 3 / 3 / 4 / 4; } /* Row 3: ▫️ */
-  .room-302 .grid-item:nth-child(11) { grid-area: 7 / 3 / 8 / 4; } /* Row 7: 4 */
-  
-  /* Col 4（上から下）: 空白, なし, なし, なし, なし, なし, 空白 */
-  .room-302 .grid-item:nth-child(12) { grid-area: 1 / 4 / 2 / 5; } /* Row 1: 空白 */
-  .room-302 .grid-item:nth-child(13) { grid-area: 7 / 4 / 8 / 5; } /* Row 7: 空白 */
-  
-  /* 右列（Col 5、上から下）: 5, 6, ▫️, 7, ▫️, ▫️, ▫️ */
-  .room-302 .grid-item:nth-child(14) { grid-area: 1 / 5 / 2 / 6; } /* Row 1: 5 */
-  .room-302 .grid-item:nth-child(15) { grid-area: 2 / 5 / 3 / 6; } /* Row 2: 6 */
-  .room-302 .grid-item:nth-child(16) { grid-area: 3 / 5 / 4 / 6; } /* Row 3: ▫️ */
-  .room-302 .grid-item:nth-child(17) { grid-area: 4 / 5 / 5 / 6; } /* Row 4: 7 */
-  .room-302 .grid-item:nth-child(18) { grid-area: 5 / 5 / 6 / 6; } /* Row 5: ▫️ */
-  .room-302 .grid-item:nth-child(19) { grid-area: 6 / 5 / 7 / 6; } /* Row 6: ▫️ */
-  .room-302 .grid-item:nth-child(20) { grid-area: 7 / 5 / 8 / 6; } /* Row 7: ▫️ */
 )rawliteral";
 
 #endif
\ No newline at end of file
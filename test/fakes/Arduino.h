@@ -0,0 +1,130 @@
+#pragma once
+// ネイティブテスト用の Arduino API の代わり（src/main.cpp をホストでビルドするため）
+// ヒープを使わないこと（test_soak はヒープ確保の回数を数える）
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define LED_BUILTIN 13
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+typedef bool boolean;
+typedef uint8_t byte;
+
+// 時刻はテストが進める
+inline unsigned long fakeMillis = 0;
+inline unsigned long millis() { return fakeMillis; }
+inline unsigned long micros() { return fakeMillis * 1000; }
+inline void delay(unsigned long ms) { fakeMillis += ms; }
+
+inline int digitalRead(int) { return LOW; }
+inline void digitalWrite(int, int) {}
+inline void pinMode(int, int) {}
+
+inline uint32_t __get_MSP(void) { return 0; }
+inline void __WFI() {}
+
+// 固定長の String（main.cpp ではファームウェアのバージョン比較にしか使わない）
+class String {
+public:
+  String(const char* s = "") {
+    strncpy(str, s ? s : "", sizeof(str) - 1);
+    str[sizeof(str) - 1] = '\0';
+  }
+  const char* c_str() const { return str; }
+  unsigned int length() const { return strlen(str); }
+  bool operator<(const char* s) const { return strcmp(str, s) < 0; }
+  bool operator==(const char* s) const { return strcmp(str, s) == 0; }
+
+private:
+  char str[32];
+};
+
+class Print;
+class Printable {
+public:
+  virtual size_t printTo(Print &p) const = 0;
+};
+
+class Print {
+public:
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buf++);
+    return n;
+  }
+  size_t write(const char* s) { return s ? write((const uint8_t*)s, strlen(s)) : 0; }
+  size_t write(const char* s, size_t n) { return write((const uint8_t*)s, n); }
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  size_t print(const char* s) { return write(s); }
+  size_t print(const __FlashStringHelper* s) { return write((const char*)s); }
+  size_t print(const String &s) { return write(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int n, int base = 10) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = 10) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = 10) {
+    if (base == 10 && n < 0) return print('-') + printNumber(0UL - (unsigned long)n, 10);
+    return printNumber((unsigned long)n, base);
+  }
+  size_t print(unsigned long n, int base = 10) { return printNumber(n, base); }
+  size_t print(double d, int digits = 2) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", digits, d);
+    return write(buf);
+  }
+  size_t print(const Printable &p) { return p.printTo(*this); }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(const T &v) { return print(v) + println(); }
+  template <typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+
+private:
+  size_t printNumber(unsigned long n, int base) {
+    if (base < 2) base = 10;
+    char buf[8 * sizeof(long) + 1];
+    char* p = buf + sizeof(buf) - 1;
+    *p = '\0';
+    do {
+      int d = n % base;
+      *--p = d < 10 ? '0' + d : 'A' + d - 10;
+      n /= base;
+    } while (n);
+    return write(p);
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  operator bool() { return true; }
+};
+inline HardwareSerial Serial;
@@ -0,0 +1,12 @@
+#pragma once
+// ネイティブテスト用の LED マトリクス（何も表示しない）
+
+#include "Arduino.h"
+
+class ArduinoLEDMatrix {
+public:
+  bool begin() { return true; }
+  void renderBitmap(uint8_t (&)[8][12], int, int) {}
+  void loadFrame(const uint32_t*) {}
+  void clear() {}
+};
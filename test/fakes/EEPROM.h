@@ -0,0 +1,22 @@
+#pragma once
+// ネイティブテスト用の EEPROM（メモリ上に持つ）
+
+#include "Arduino.h"
+
+struct EEPROMClass {
+  uint8_t data[8192];
+
+  template <class T> T &get(int addr, T &t) {
+    memcpy(&t, data + addr, sizeof(T));
+    return t;
+  }
+  template <class T> const T &put(int addr, const T &t) {
+    memcpy(data + addr, &t, sizeof(T));
+    return t;
+  }
+  uint8_t read(int addr) { return data[addr]; }
+  void write(int addr, uint8_t v) { data[addr] = v; }
+  void update(int addr, uint8_t v) { data[addr] = v; }
+  uint16_t length() { return sizeof(data); }
+};
+inline EEPROMClass EEPROM;
@@ -0,0 +1,49 @@
+#pragma once
+// ネイティブテスト用の IPAddress
+
+#include "Arduino.h"
+
+class IPAddress : public Printable {
+public:
+  IPAddress() { memset(bytes, 0, sizeof(bytes)); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    bytes[0] = a;
+    bytes[1] = b;
+    bytes[2] = c;
+    bytes[3] = d;
+  }
+  IPAddress(uint32_t v) { memcpy(bytes, &v, sizeof(bytes)); }
+
+  uint8_t operator[](int i) const { return bytes[i]; }
+  uint8_t &operator[](int i) { return bytes[i]; }
+  operator uint32_t() const {
+    uint32_t v;
+    memcpy(&v, bytes, sizeof(v));
+    return v;
+  }
+  bool operator==(const IPAddress &o) const { return memcmp(bytes, o.bytes, sizeof(bytes)) == 0; }
+  bool operator!=(const IPAddress &o) const { return !(*this == o); }
+
+  bool fromString(const char* s) {
+    unsigned a, b, c, d;
+    char extra;
+    if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 ||
+        a > 255 || b > 255 || c > 255 || d > 255) {
+      return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+
+  size_t printTo(Print &p) const override {
+    size_t n = 0;
+    for (int i = 0; i < 4; i++) {
+      if (i > 0) n += p.print('.');
+      n += p.print((unsigned int)bytes[i]);
+    }
+    return n;
+  }
+
+private:
+  uint8_t bytes[4];
+};
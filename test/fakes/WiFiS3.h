@@ -0,0 +1,163 @@
+#pragma once
+// ネイティブテスト用の WiFiS3
+// 接続は固定数の FakeSocket で表し、テストが受信データを渡して応答を受け取る
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+enum {
+  WL_NO_SHIELD = 255,
+  WL_NO_MODULE = 255,
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL,
+  WL_SCAN_COMPLETED,
+  WL_CONNECTED,
+  WL_CONNECT_FAILED,
+  WL_CONNECTION_LOST,
+  WL_DISCONNECTED
+};
+#define WIFI_FIRMWARE_LATEST_VERSION "0.4.1"
+
+const int FAKE_SOCKETS = 8;
+const size_t FAKE_OUT_MAX = 512;  // 応答の先頭だけ残す
+
+struct FakeSocket {
+  bool open;
+  uint16_t localPort;
+  uint32_t remoteIp;
+  const char* in;           // 受信データ（テストが持つ）
+  size_t inLen;
+  size_t inPos;
+  char out[FAKE_OUT_MAX];   // 応答の先頭
+  size_t outLen;
+  size_t outTotal;          // 応答の全長
+};
+inline FakeSocket fakeSockets[FAKE_SOCKETS];
+inline FakeSocket* fakeIncoming = nullptr; // 次に server.available() が返す接続
+inline bool fakeAcceptOutgoing = false;     // client.connect() を成功させるか
+inline FakeSocket* fakeOutgoing = nullptr;  // 最後に client.connect() で開いた接続
+
+/**
+ * @brief 新しい接続を作り、次の server.available() で返されるようにする
+ * @return 接続（空きがなければ nullptr）
+ */
+inline FakeSocket* fakeConnect(uint16_t port, uint32_t remoteIp, const char* data, size_t len) {
+  for (int i = 0; i < FAKE_SOCKETS; i++) {
+    FakeSocket &s = fakeSockets[i];
+    if (s.open || &s == fakeIncoming) continue;
+    s.open = true;
+    s.localPort = port;
+    s.remoteIp = remoteIp;
+    s.in = data;
+    s.inLen = len;
+    s.inPos = 0;
+    s.out[0] = '\0';
+    s.outLen = 0;
+    s.outTotal = 0;
+    fakeIncoming = &s;
+    return &s;
+  }
+  return nullptr;
+}
+
+class WiFiClient : public Stream {
+public:
+  WiFiClient() {}
+  explicit WiFiClient(FakeSocket* s) : sock(s) {}
+
+  int connect(IPAddress ip, uint16_t port) {
+    if (!fakeAcceptOutgoing) return 0;
+    for (int i = 0; i < FAKE_SOCKETS; i++) {
+      FakeSocket &s = fakeSockets[i];
+      if (s.open || &s == fakeIncoming) continue;
+      s.open = true;
+      s.localPort = port;
+      s.remoteIp = (uint32_t)ip;
+      s.in = nullptr;
+      s.inLen = 0;
+      s.inPos = 0;
+      s.out[0] = '\0';
+      s.outLen = 0;
+      s.outTotal = 0;
+      sock = &s;
+      fakeOutgoing = &s;
+      return 1;
+    }
+    return 0;
+  }
+  int connect(const char*, uint16_t) { return 0; }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buf, size_t size) override {
+    if (sock == nullptr || !sock->open) return 0;
+    size_t n = size;
+    if (n > FAKE_OUT_MAX - 1 - sock->outLen) n = FAKE_OUT_MAX - 1 - sock->outLen;
+    memcpy(sock->out + sock->outLen, buf, n);
+    sock->outLen += n;
+    sock->out[sock->outLen] = '\0';
+    sock->outTotal += size;
+    return size;
+  }
+  using Print::write;
+
+  int available() override {
+    return (sock != nullptr && sock->open) ? (int)(sock->inLen - sock->inPos) : 0;
+  }
+  int read() override { return available() ? (uint8_t)sock->in[sock->inPos++] : -1; }
+  int read(uint8_t* buf, size_t size) {
+    int n = 0;
+    while ((size_t)n < size && available()) buf[n++] = read();
+    return n;
+  }
+  int peek() override { return available() ? (uint8_t)sock->in[sock->inPos] : -1; }
+  void flush() override {}
+  void stop() {
+    // 本物と同じく、閉じた後は同じ番号を再利用した別の接続に触れない
+    if (sock != nullptr) sock->open = false;
+    sock = nullptr;
+  }
+  uint8_t connected() { return sock != nullptr && sock->open; }
+  operator bool() { return sock != nullptr && sock->open; }
+  bool operator==(const WiFiClient &o) const { return sock == o.sock; }
+  bool operator!=(const WiFiClient &o) const { return sock != o.sock; }
+
+  IPAddress remoteIP() { return IPAddress(sock != nullptr ? sock->remoteIp : 0); }
+  uint16_t remotePort() { return 0; }
+
+private:
+  FakeSocket* sock = nullptr;
+};
+
+class WiFiServer {
+public:
+  WiFiServer(int p) : port(p) {}
+  void begin() {}
+  void end() {}
+  WiFiClient available() {
+    if (fakeIncoming == nullptr || fakeIncoming->localPort != port) return WiFiClient();
+    FakeSocket* s = fakeIncoming;
+    fakeIncoming = nullptr;
+    return WiFiClient(s);
+  }
+  WiFiClient accept() { return available(); }
+
+private:
+  int port;
+};
+
+class CWifi {
+public:
+  int status() { return WL_CONNECTED; }
+  void setTimeout(unsigned long) {}
+  const char* firmwareVersion() { return WIFI_FIRMWARE_LATEST_VERSION; }
+  int begin(const char*, const char*) { return WL_CONNECTED; }
+  void config(IPAddress, IPAddress, IPAddress, IPAddress) {}
+  const char* SSID() { return "fake"; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+  IPAddress subnetMask() { return IPAddress(255, 0, 0, 0); }
+  IPAddress gatewayIP() { return IPAddress(127, 0, 0, 1); }
+  long RSSI() { return -40; }
+  int disconnect() { return 0; }
+  void end() {}
+};
+inline CWifi WiFi;
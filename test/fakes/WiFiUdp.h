@@ -0,0 +1,25 @@
+#pragma once
+// ネイティブテスト用の WiFiUDP（何も送受信しない）
+
+#include "WiFiS3.h"
+
+class WiFiUDP : public Stream {
+public:
+  uint8_t begin(uint16_t) { return 1; }
+  uint8_t beginMulticast(IPAddress, uint16_t) { return 1; }
+  void stop() {}
+  int beginPacket(IPAddress, uint16_t) { return 1; }
+  int endPacket() { return 1; }
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t size) override { return size; }
+  using Print::write;
+  int parsePacket() { return 0; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int read(unsigned char*, size_t) { return 0; }
+  int read(char*, size_t) { return 0; }
+  int peek() override { return -1; }
+  void flush() override {}
+  IPAddress remoteIP() { return IPAddress(); }
+  uint16_t remotePort() { return 0; }
+};
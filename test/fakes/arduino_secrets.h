@@ -0,0 +1,5 @@
+#pragma once
+// ネイティブテスト用（接続はしない）
+#define SECRET_SSID "test"
+#define SECRET_PASS "test"
+#define SECRET_ADMIN_TOKEN "test-token"
@@ -0,0 +1,276 @@
+// クラスタ（cluster_proto.h）のネイティブテスト
+// 3台のボードを localhost の UDP ソケットで模擬し、状態の複製・再起動・停止を確認する
+//
+// 実行: pio test -e native -f test_cluster
+
+#include <unity.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#include "cluster_proto.h"
+
+const int NODE_COUNT = 3;
+const uint16_t BASE_PORT = 42100;
+const unsigned long SYNC_INTERVAL = 2000;
+const unsigned long ROOM_TIMEOUT = 10000;
+const unsigned long TICK_MS = 100;
+
+// ボード1は 301/302、ボード2は 303、ボード3は 304 を担当する
+const int ROOMS_1[] = {301, 302};
+const int ROOMS_2[] = {303};
+const int ROOMS_3[] = {304};
+
+struct SimBoard {
+  ClusterNode node;
+  uint32_t versions[2];
+  uint16_t masks[2];          // 担当する部屋の現在の状態
+  unsigned long nextSync;
+  int sock;
+  bool running;               // false なら停止中（送受信しない）
+  int changes;                // onChange が呼ばれた回数
+};
+SimBoard boards[NODE_COUNT];
+int currentBoard = 0;         // onChange の呼び出し元
+unsigned long now = 0;
+int dropPercent = 0;          // 送信を捨てる割合 (%)
+uint32_t dropSeed = 1;        // 捨てるパケットを決める疑似乱数（毎回同じ結果にするため固定）
+
+void countChange(int room, int box, bool set) {
+  (void)room;
+  (void)box;
+  (void)set;
+  boards[currentBoard].changes++;
+}
+
+void initBoard(int i, uint8_t id, const int* rooms, int count) {
+  SimBoard &b = boards[i];
+  memset(&b, 0, sizeof(b));
+  b.node.id = id;
+  b.node.localRooms = rooms;
+  b.node.localRoomCount = count;
+  b.node.localVersion = b.versions;
+  b.running = true;
+
+  b.sock = socket(AF_INET, SOCK_DGRAM, 0);
+  int on = 1;
+  setsockopt(b.sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(BASE_PORT + i);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  TEST_ASSERT_EQUAL(0, bind(b.sock, (sockaddr*)&addr, sizeof(addr)));
+  fcntl(b.sock, F_SETFL, O_NONBLOCK);
+}
+
+// 自分の部屋の状態を変える（recordChange() と同じくバージョンを上げる）
+void setMask(int i, int localIdx, uint16_t mask) {
+  boards[i].masks[localIdx] = mask;
+  boards[i].versions[localIdx]++;
+  boards[i].node.dirty = true;
+}
+
+void sendToPeers(int from, const uint8_t* buf, size_t len) {
+  for (int j = 0; j < NODE_COUNT; j++) {
+    if (j == from) continue;
+    dropSeed = dropSeed * 1103515245 + 12345;
+    if ((int)((dropSeed >> 16) % 100) < dropPercent) continue;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BASE_PORT + j);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(boards[from].sock, buf, len, 0, (sockaddr*)&addr, sizeof(addr));
+  }
+}
+
+// pollCluster() と同じ手順を全ボードで1回ずつ行い、時刻を進める
+void tick() {
+  for (int i = 0; i < NODE_COUNT; i++) {
+    SimBoard &b = boards[i];
+    currentBoard = i;
+    uint8_t buf[512];
+    int len;
+    while ((len = recv(b.sock, buf, sizeof(buf), 0)) > 0) {
+      if (b.running) clusterMergeState(b.node, buf, len, now, countChange);
+    }
+    if (!b.running) continue;
+
+    if (b.node.dirty || (long)(now - b.nextSync) >= 0) {
+      clusterExpireRooms(b.node, now, ROOM_TIMEOUT, countChange);
+      size_t n = clusterEncodeState(b.node, b.masks, buf);
+      sendToPeers(i, buf, n);
+      b.node.dirty = false;
+      b.nextSync = now + SYNC_INTERVAL;
+    }
+  }
+  usleep(1000); // localhost の配送を待つ
+  now += TICK_MS;
+}
+
+void runFor(unsigned long ms) {
+  unsigned long end = now + ms;
+  while ((long)(now - end) < 0) tick();
+}
+
+// board が知っている room の状態（知らなければ false）
+bool findRoom(int board, int room, ClusterRoom &out) {
+  for (int r = 0; r < CLUSTER_MAX_ROOMS; r++) {
+    const ClusterRoom &cr = boards[board].node.rooms[r];
+    if (cr.used && cr.room == room) {
+      out = cr;
+      return true;
+    }
+  }
+  return false;
+}
+
+void assertSees(int board, int room, uint16_t mask) {
+  ClusterRoom cr;
+  TEST_ASSERT_TRUE_MESSAGE(findRoom(board, room, cr), "room not known");
+  TEST_ASSERT_EQUAL_HEX16(mask, cr.mask);
+}
+
+void assertConverged() {
+  assertSees(1, 301, boards[0].masks[0]);
+  assertSees(1, 302, boards[0].masks[1]);
+  assertSees(2, 301, boards[0].masks[0]);
+  assertSees(2, 302, boards[0].masks[1]);
+  assertSees(0, 303, boards[1].masks[0]);
+  assertSees(2, 303, boards[1].masks[0]);
+  assertSees(0, 304, boards[2].masks[0]);
+  assertSees(1, 304, boards[2].masks[0]);
+}
+
+void setUp() {
+  now = 1;
+  dropPercent = 0;
+  dropSeed = 1;
+  initBoard(0, 1, ROOMS_1, 2);
+  initBoard(1, 2, ROOMS_2, 1);
+  initBoard(2, 3, ROOMS_3, 1);
+}
+
+void tearDown() {
+  for (int i = 0; i < NODE_COUNT; i++) close(boards[i].sock);
+}
+
+void test_packet_roundtrip() {
+  setMask(0, 0, 0x8001);
+  uint8_t buf[256];
+  size_t len = clusterEncodeState(boards[0].node, boards[0].masks, buf);
+  TEST_ASSERT_EQUAL(CLUSTER_HEADER_SIZE + 2 * CLUSTER_ENTRY_SIZE, (int)len);
+
+  uint8_t type, sender;
+  int count;
+  TEST_ASSERT_TRUE(clusterParseHeader(buf, len, type, sender, count));
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_STATE, type);
+  TEST_ASSERT_EQUAL(1, sender);
+  TEST_ASSERT_EQUAL(2, count);
+  TEST_ASSERT_EQUAL(301, getU16(buf + CLUSTER_HEADER_SIZE));
+  TEST_ASSERT_EQUAL_HEX16(0x8001, getU16(buf + CLUSTER_HEADER_SIZE + 3));
+  TEST_ASSERT_EQUAL(1, getU32(buf + CLUSTER_HEADER_SIZE + 5));
+
+  buf[0] = 'X';
+  TEST_ASSERT_FALSE(clusterParseHeader(buf, len, type, sender, count));
+}
+
+void test_all_boards_converge() {
+  setMask(0, 0, 0x0005);
+  setMask(0, 1, 0x0100);
+  setMask(1, 0, 0x00F0);
+  setMask(2, 0, 0x8000);
+  runFor(500);
+  assertConverged();
+
+  // 変化はすぐに（定期送信を待たずに）伝わる
+  setMask(1, 0, 0x0001);
+  runFor(300);
+  assertConverged();
+}
+
+void test_converges_with_packet_loss() {
+  dropPercent = 30;
+  setMask(0, 0, 0x0003);
+  setMask(1, 0, 0x0030);
+  setMask(2, 0, 0x0300);
+  runFor(3 * SYNC_INTERVAL);
+  assertConverged();
+}
+
+void test_versions_settle_under_anti_entropy() {
+  setMask(0, 0, 0x0001);
+  setMask(1, 0, 0x0002);
+  setMask(2, 0, 0x0004);
+  runFor(SYNC_INTERVAL);
+  uint32_t v1 = boards[0].versions[0];
+  uint32_t v2 = boards[1].versions[0];
+  uint32_t v3 = boards[2].versions[0];
+
+  // 変化がなければ、中継で自分のバージョンが戻ってきても上がらない
+  runFor(10 * SYNC_INTERVAL);
+  TEST_ASSERT_EQUAL(v1, boards[0].versions[0]);
+  TEST_ASSERT_EQUAL(v2, boards[1].versions[0]);
+  TEST_ASSERT_EQUAL(v3, boards[2].versions[0]);
+  assertConverged();
+}
+
+void test_rebooted_board_overrides_stale_version() {
+  for (int n = 0; n < 5; n++) setMask(1, 0, 0x00FF);
+  runFor(500);
+  assertSees(0, 303, 0x00FF);
+
+  // ボード2が再起動してバージョンが 0 に戻る
+  boards[1].versions[0] = 0;
+  boards[1].masks[0] = 0;
+  memset(boards[1].node.rooms, 0, sizeof(boards[1].node.rooms));
+  setMask(1, 0, 0x0001);
+  runFor(2 * SYNC_INTERVAL);
+
+  TEST_ASSERT_TRUE(boards[1].versions[0] > 5);
+  assertConverged();
+}
+
+void test_stopped_board_rooms_expire() {
+  setMask(2, 0, 0x0F00);
+  runFor(500);
+  assertSees(0, 304, 0x0F00);
+  int changesBefore = boards[0].changes;
+
+  // ボード3が止まる（他の2台は互いに 304 を中継し続ける）
+  boards[2].running = false;
+  runFor(ROOM_TIMEOUT + 2 * SYNC_INTERVAL);
+
+  ClusterRoom cr;
+  TEST_ASSERT_FALSE(findRoom(0, 304, cr));
+  TEST_ASSERT_FALSE(findRoom(1, 304, cr));
+  TEST_ASSERT_TRUE(boards[0].changes > changesBefore); // 全解除が記録された
+
+  // 中継で生き返らない
+  runFor(3 * SYNC_INTERVAL);
+  TEST_ASSERT_FALSE(findRoom(0, 304, cr));
+  TEST_ASSERT_FALSE(findRoom(1, 304, cr));
+  assertSees(1, 301, boards[0].masks[0]);
+
+  // 再開すれば戻る
+  boards[2].running = true;
+  runFor(SYNC_INTERVAL + 500);
+  assertSees(0, 304, 0x0F00);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_packet_roundtrip);
+  RUN_TEST(test_all_boards_converge);
+  RUN_TEST(test_converges_with_packet_loss);
+  RUN_TEST(test_versions_settle_under_anti_entropy);
+  RUN_TEST(test_rebooted_board_overrides_stale_version);
+  RUN_TEST(test_stopped_board_rooms_expire);
+  return UNITY_END();
+}
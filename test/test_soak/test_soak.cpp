@@ -0,0 +1,411 @@
+// HTTP 処理の長時間テスト（ネイティブ）
+// src/main.cpp を test/fakes の Arduino API の代わりと一緒にビルドし、
+// 全エンドポイント（ページ・/api/changes・/api/stats・/api/metrics・/api/subscribers・
+// POST のコマンド）へのリクエストを約100万回通して
+// ヒープ確保が1回も起きないことを確認する（確保の回数は MEM_TRACE の --wrap で数える）
+//
+// 実行: pio test -e native_soak
+
+#include <unity.h>
+
+#include "../../src/main.cpp"
+
+// 計測しない環境（ホスト）では sbrk の位置は使わない（__HeapLimit がないため）
+extern "C" void* _sbrk(ptrdiff_t) { return nullptr; }
+
+const long SOAK_REQUESTS = 1000000;
+const long WARMUP_REQUESTS = 1000;
+const uint32_t CLIENT_IP = 0x0200000A;   // 10.0.0.2
+const unsigned long REQUEST_GAP_MS = 1000; // トークンが減り続けない間隔
+const char ADMIN_HEADER[] = "X-Admin-Token: " SECRET_ADMIN_TOKEN "\r\n";
+
+char requestBuf[512];
+char bodyBuf[320];
+long clientSeq = 0;
+
+/**
+ * @brief リクエストを1件送り、接続が閉じるまで handleClient() を回す
+ * @return 応答を受け取った接続
+ */
+FakeSocket* sendRequest(const char* data) {
+  FakeSocket* s = fakeConnect(80, CLIENT_IP, data, strlen(data));
+  TEST_ASSERT_NOT_NULL(s);
+  for (int n = 0; n < 50 && s->open; n++) {
+    handleClient();
+    fakeMillis++;
+  }
+  TEST_ASSERT_FALSE_MESSAGE(s->open, "request did not finish");
+  Log.drain(sizeof(requestBuf));
+  fakeMillis += REQUEST_GAP_MS;
+  return s;
+}
+
+const char* post(const char* body, const char* extraHeader = "", const char* path = "/api/box") {
+  snprintf(requestBuf, sizeof(requestBuf),
+           "POST %s HTTP/1.1\r\nHost: board\r\nContent-Type: application/json\r\n"
+           "%sContent-Length: %u\r\n\r\n%s",
+           path, extraHeader, (unsigned)strlen(body), body);
+  return requestBuf;
+}
+
+const char* get(const char* path) {
+  snprintf(requestBuf, sizeof(requestBuf),
+           "GET %s HTTP/1.1\r\nHost: board\r\nAccept: */*\r\n\r\n", path);
+  return requestBuf;
+}
+
+const char* deleteSubscriber(int id) {
+  snprintf(requestBuf, sizeof(requestBuf), "DELETE /api/subscribers/%d HTTP/1.1\r\n%s\r\n", id, ADMIN_HEADER);
+  return requestBuf;
+}
+
+bool statusIs(const FakeSocket* s, const char* status) {
+  return strncmp(s->out, status, strlen(status)) == 0;
+}
+
+/**
+ * @brief i 番目のリクエストを組み立てる（種類を順番に回す）
+ * @param expected 期待するステータス行の先頭を返す
+ */
+const char* soakRequest(long i, const char* &expected) {
+  char header[64];
+  char path[48];
+  int box = (int)(i % 16) + 1;
+  expected = "HTTP/1.1 200";
+
+  switch (i % 16) {
+    case 0:
+      snprintf(bodyBuf, sizeof(bodyBuf),
+               "{\"room\":\"301\",\"box\":%d,\"action\":\"set\",\"clientId\":\"soak\",\"seq\":%ld}",
+               box, ++clientSeq);
+      return post(bodyBuf);
+    case 1:
+      snprintf(header, sizeof(header), "Idempotency-Key: k-%ld\r\n", i);
+      snprintf(bodyBuf, sizeof(bodyBuf), "{ \"room\" : \"302\", \"box\" : \"%d\", \"action\" : \"clear\" }", box);
+      return post(bodyBuf, header);
+    case 2:
+      // 直前と同じ冪等キー（重複として無視される）
+      snprintf(header, sizeof(header), "Idempotency-Key: k-%ld\r\n", i - 1);
+      return post(bodyBuf, header);
+    case 3:
+      snprintf(bodyBuf, sizeof(bodyBuf), "{\"productNumber\": %d}", box);
+      return post(bodyBuf);
+    case 4:
+      // 差分、または履歴から外れていれば全状態
+      snprintf(path, sizeof(path), "/api/changes?since=%lu", journalSeq - (unsigned long)(i % 80));
+      return get(path);
+    case 5:
+      return get("/api/changes");
+    case 6:
+      snprintf(bodyBuf, sizeof(bodyBuf), "{\"room\":\"%s\",\"action\":\"clear\"}", (i % 20) < 10 ? "301" : "302");
+      return post(bodyBuf);
+    case 7:
+      // 長すぎる行とボディ（切り捨てられる）
+      memset(bodyBuf, 'x', sizeof(bodyBuf) - 1);
+      bodyBuf[sizeof(bodyBuf) - 1] = '\0';
+      memcpy(bodyBuf, "{\"room\":\"302\",\"box\":5,\"action\":\"set\",\"pad\":\"", 45);
+      snprintf(path, sizeof(path), "/api/changes?since=%ld&", i);
+      snprintf(requestBuf, sizeof(requestBuf),
+               "POST %s%s HTTP/1.1\r\nContent-Length: %u\r\n\r\n%s",
+               path, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+               (unsigned)strlen(bodyBuf), bodyBuf);
+      return requestBuf;
+    case 8:
+      // 部屋番号のない・壊れた JSON
+      return post((i % 20) < 10 ? "{\"box\":3,\"action\":\"set\"}" : "{\"room\":");
+    case 9:
+      expected = "HTTP/1.1 204";
+      snprintf(requestBuf, sizeof(requestBuf),
+               "OPTIONS /api/box HTTP/1.1\r\nOrigin: https://example.com\r\n\r\n");
+      return requestBuf;
+    case 10:
+      return get("/");
+    case 11:
+      return get("/api/stats");
+    case 12:
+      return get("/api/metrics");
+    case 13:
+      // 登録して一覧を取り、次で削除する（空いている最初の番号 0 が使われる）
+      expected = "HTTP/1.1 201";
+      snprintf(bodyBuf, sizeof(bodyBuf), "{\"ip\":\"10.0.1.%ld\",\"port\":8080,\"path\":\"/api/box\"}",
+               i % 200 + 1);
+      return post(bodyBuf, ADMIN_HEADER, "/api/subscribers");
+    case 14:
+      return get("/api/subscribers");
+    default:
+      expected = "HTTP/1.1 204";
+      snprintf(requestBuf, sizeof(requestBuf), "DELETE /api/subscribers/0 HTTP/1.1\r\nHost: board\r\n%s\r\n", ADMIN_HEADER);
+      return requestBuf;
+  }
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_post_is_visible_in_changes() {
+  unsigned long seqBefore = journalSeq;
+  FakeSocket* s = sendRequest(post("{\"room\":\"301\",\"box\":3,\"action\":\"set\"}"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 200"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"ok\"}"));
+  TEST_ASSERT_EQUAL(seqBefore + 1, journalSeq);
+
+  char path[48];
+  snprintf(path, sizeof(path), "/api/changes?since=%lu", seqBefore);
+  s = sendRequest(get(path));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 200"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"full\":false"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"room\":\"301\",\"box\":3,\"action\":\"set\"}]}"));
+}
+
+void test_changes_full_after_reboot() {
+  sendRequest(post("{\"room\":\"301\",\"box\":4,\"action\":\"set\"}"));
+  char path[64];
+  snprintf(path, sizeof(path), "/api/changes?since=%lu&boot=%lu", journalSeq - 1, (unsigned long)bootId);
+  FakeSocket* s = sendRequest(get(path));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"full\":false"));
+
+  // 前回の応答が別の起動のものなら、seq が範囲内でも全状態を返す
+  snprintf(path, sizeof(path), "/api/changes?since=%lu&boot=%lu", journalSeq - 1, (unsigned long)bootId + 1);
+  s = sendRequest(get(path));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"full\":true"));
+  snprintf(path, sizeof(path), "{\"boot\":%lu,", (unsigned long)bootId);
+  TEST_ASSERT_NOT_NULL(strstr(s->out, path));
+}
+
+void test_duplicate_key_is_ignored() {
+  unsigned long seqBefore = journalSeq;
+  const char* body = "{\"room\":\"302\",\"box\":2,\"action\":\"set\"}";
+  FakeSocket* s = sendRequest(post(body, "Idempotency-Key: dup-1\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"ok\"}"));
+  s = sendRequest(post(body, "Idempotency-Key: dup-1\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"duplicate\"}"));
+  TEST_ASSERT_EQUAL(seqBefore + 1, journalSeq);
+}
+
+void test_rejected_command_does_not_use_seq() {
+  unsigned long seqBefore = journalSeq;
+  // 区画番号が不正なコマンドの seq は記録しない
+  sendRequest(post("{\"clientId\":\"t1\",\"seq\":5,\"room\":\"302\",\"box\":99,\"action\":\"set\"}"));
+  FakeSocket* s = sendRequest(post("{\"clientId\":\"t1\",\"seq\":5,\"room\":\"302\",\"box\":4,\"action\":\"set\"}"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"ok\"}"));
+  TEST_ASSERT_EQUAL(seqBefore + 1, journalSeq);
+  s = sendRequest(post("{\"clientId\":\"t1\",\"seq\":5,\"room\":\"302\",\"box\":4,\"action\":\"clear\"}"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"duplicate\"}"));
+}
+
+void test_client_restart_resets_seq() {
+  sendRequest(post("{\"clientId\":\"t2\",\"seq\":1000,\"room\":\"302\",\"box\":7,\"action\":\"set\"}"));
+  // 少し戻った seq は再送として捨てる
+  FakeSocket* s = sendRequest(post("{\"clientId\":\"t2\",\"seq\":990,\"room\":\"302\",\"box\":7,\"action\":\"clear\"}"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"duplicate\"}"));
+  // 大きく戻ったら再起動とみなす
+  s = sendRequest(post("{\"clientId\":\"t2\",\"seq\":1,\"room\":\"302\",\"box\":7,\"action\":\"clear\"}"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"ok\"}"));
+  // しばらく使われなかったクライアントの seq は忘れる
+  fakeMillis += DEDUPE_TTL;
+  s = sendRequest(post("{\"clientId\":\"t2\",\"seq\":1,\"room\":\"302\",\"box\":7,\"action\":\"set\"}"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "{\"status\":\"ok\"}"));
+}
+
+void test_full_snapshot_is_in_box_order() {
+  sendRequest(post("{\"room\":\"302\",\"action\":\"clear\"}"));
+  sendRequest(post("{\"room\":\"302\",\"box\":1,\"action\":\"set\"}"));
+  FakeSocket* s = sendRequest(get("/api/changes?since=999999999"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"full\":true"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"302\":\"1000000000000000\""));
+}
+
+// 接続したまま何もしない・途中まで送る接続は HTTP_HEADER_TIMEOUT で閉じる
+FakeSocket* idleConnection(const char* data, uint32_t ip) {
+  FakeSocket* s = fakeConnect(80, ip, data, strlen(data));
+  TEST_ASSERT_NOT_NULL(s);
+  for (unsigned long t = 0; t <= HTTP_HEADER_TIMEOUT && s->open; t += 10) {
+    handleClient();
+    fakeMillis += 10;
+  }
+  TEST_ASSERT_FALSE(s->open);
+  fakeMillis += REQUEST_GAP_MS * 10;
+  return s;
+}
+
+void test_stall_is_charged_only_for_partial_requests() {
+  const uint32_t ip = 0x0300000A; // 10.0.0.3
+  unsigned long stalledBefore = rejectedStalled;
+
+  // ブラウザの先読み接続: 黙って閉じ、トークンは課さない
+  FakeSocket* s = idleConnection("", ip);
+  TEST_ASSERT_EQUAL(0, (int)s->outTotal);
+  TEST_ASSERT_EQUAL(stalledBefore, rejectedStalled);
+
+  s = idleConnection("GET / HT", ip);
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 408"));
+  TEST_ASSERT_EQUAL(stalledBefore + 1, rejectedStalled);
+
+  // rateExemptIps（ループバック）には課さない
+  s = idleConnection("GET / HT", 0x0100007F);
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 408"));
+  int retryAfter;
+  TEST_ASSERT_TRUE(takeRateTokens(0x0100007F, 100, 0, retryAfter));
+}
+
+void test_link_down_releases_connections() {
+  FakeSocket* s = fakeConnect(80, CLIENT_IP, "GET / HT", 8);
+  handleClient();
+  TEST_ASSERT_TRUE(httpReady());
+
+  wifiState = WIFI_STATE_CONNECTED;
+  markLinkDown(millis());
+  TEST_ASSERT_FALSE(httpReady());
+  TEST_ASSERT_FALSE(s->open);
+  fakeMillis += REQUEST_GAP_MS;
+}
+
+void test_subscriber_list_is_not_truncated() {
+  FakeSocket* s = sendRequest(post("{\"ip\":\"255.255.255.254\",\"port\":65535,\"path\":\"/a-very-long-path-xxxxxx\"}",
+                                   ADMIN_HEADER, "/api/subscribers"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 201"));
+  // 長く動いた後の最大の桁数
+  Subscriber &sub = subscribers[0];
+  sub.delivered = sub.failures = sub.dropped = 4294967295UL;
+  sub.backoff = SUBSCRIBER_BACKOFF_MAX;
+  s = sendRequest(get("/api/subscribers"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"path\":\"/a-very-long-path-xxxxx\",\"persistent\":true,\"wsReplaces\":false,\"queued\":0,"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"backoffMs\":30000,\"latencyMs\":"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "}}]}"));
+  sendRequest(deleteSubscriber(0));
+}
+
+void test_subscriber_status_split_across_reads() {
+  FakeSocket* s = sendRequest(post("{\"ip\":\"10.0.1.9\",\"port\":8080,\"path\":\"/hook\"}",
+                                   ADMIN_HEADER, "/api/subscribers"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 201"));
+  Subscriber &sub = subscribers[0];
+  queueNotify("101", 1, "set");
+
+  fakeAcceptOutgoing = true;
+  pollSubscribers();
+  fakeAcceptOutgoing = false;
+  TEST_ASSERT_EQUAL(SUB_WAITING, sub.state);
+  FakeSocket* out = fakeOutgoing;
+
+  // ステータス行が2回に分かれて届く
+  const char* response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+  out->in = response;
+  out->inLen = 5;
+  pollSubscribers();
+  TEST_ASSERT_EQUAL(SUB_WAITING, sub.state);
+  out->inLen = strlen(response);
+  pollSubscribers();
+  TEST_ASSERT_EQUAL(SUB_IDLE, sub.state);
+  TEST_ASSERT_EQUAL(1, sub.delivered);
+  TEST_ASSERT_EQUAL(0, sub.failures);
+  sendRequest(deleteSubscriber(0));
+}
+
+void test_subscriber_changes_need_admin_token() {
+  const char* body = "{\"ip\":\"10.0.1.9\",\"port\":8080}";
+  FakeSocket* s = sendRequest(post(body, "", "/api/subscribers"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 401"));
+  s = sendRequest(post(body, "X-Admin-Token: test-tokex\r\n", "/api/subscribers"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 401"));
+  s = sendRequest(post(body, "X-Admin-Token: test-token-2\r\n", "/api/subscribers"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 401"));
+  TEST_ASSERT_FALSE(subscribers[0].used);
+
+  s = sendRequest(post(body, ADMIN_HEADER, "/api/subscribers"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 201"));
+  s = sendRequest("DELETE /api/subscribers/0 HTTP/1.1\r\n\r\n");
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 401"));
+  TEST_ASSERT_TRUE(subscribers[0].used);
+  s = sendRequest(deleteSubscriber(0));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 204"));
+}
+
+void test_metrics_report_boot_timings() {
+  FakeSocket* s = sendRequest(get("/api/metrics"));
+  TEST_ASSERT_TRUE(statusIs(s, "HTTP/1.1 200"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, "\"boot\":{\"toFirstScanMs\":"));
+  TEST_ASSERT_NOT_NULL(strstr(s->out, ",\"toFirstServeMs\":"));
+}
+
+void test_remote_change_does_not_redraw_matrix() {
+  updateMatrix();
+  unsigned long redraws = matrixRedraws;
+  unsigned long seqBefore = journalSeq;
+  clusterRecordChange(401, 3, true);
+  TEST_ASSERT_EQUAL(seqBefore + 1, journalSeq);
+  updateMatrix();
+  TEST_ASSERT_EQUAL(redraws, matrixRedraws);
+
+  sendRequest(post("{\"room\":\"302\",\"box\":8,\"action\":\"set\"}"));
+  updateMatrix();
+  TEST_ASSERT_EQUAL(redraws + 1, matrixRedraws);
+}
+
+void test_remote_change_is_not_announced() {
+  pollAnnounce();
+  unsigned long sent = announceSent;
+  clusterRecordChange(401, 4, true);
+  pollAnnounce();
+  TEST_ASSERT_EQUAL(sent, announceSent);
+
+  recordChange("302", 8, "clear");
+  pollAnnounce();
+  TEST_ASSERT_EQUAL(sent + 1, announceSent);
+  fakeMillis += REQUEST_GAP_MS;
+}
+
+void test_malloc_is_counted() {
+  // --wrap が効いていなければ下の確認は意味がないので先に確かめる
+  unsigned long before = allocCount;
+  void* volatile p = malloc(16);
+  free(p);
+  TEST_ASSERT_EQUAL(before + 1, allocCount);
+}
+
+void test_soak_does_not_allocate() {
+  const char* expected;
+  for (long i = 0; i < WARMUP_REQUESTS; i++) {
+    sendRequest(soakRequest(i, expected));
+  }
+
+  unsigned long allocsBefore = allocCount;
+  unsigned long seqBefore = journalSeq;
+  long unexpected = 0;
+  for (long i = 0; i < SOAK_REQUESTS; i++) {
+    const char* req = soakRequest(i, expected);
+    FakeSocket* s = sendRequest(req);
+    if (!statusIs(s, expected)) {
+      if (unexpected == 0) TEST_MESSAGE(s->out);
+      unexpected++;
+    }
+  }
+
+  TEST_ASSERT_EQUAL(0, unexpected);
+  TEST_ASSERT_EQUAL(allocsBefore, allocCount);
+  TEST_ASSERT_EQUAL(0, requestAllocsMax);
+  TEST_ASSERT_TRUE(journalSeq > seqBefore + SOAK_REQUESTS / 10);
+}
+
+int main() {
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_post_is_visible_in_changes);
+  RUN_TEST(test_changes_full_after_reboot);
+  RUN_TEST(test_duplicate_key_is_ignored);
+  RUN_TEST(test_rejected_command_does_not_use_seq);
+  RUN_TEST(test_client_restart_resets_seq);
+  RUN_TEST(test_full_snapshot_is_in_box_order);
+  RUN_TEST(test_stall_is_charged_only_for_partial_requests);
+  RUN_TEST(test_link_down_releases_connections);
+  RUN_TEST(test_subscriber_list_is_not_truncated);
+  RUN_TEST(test_subscriber_status_split_across_reads);
+  RUN_TEST(test_subscriber_changes_need_admin_token);
+  RUN_TEST(test_metrics_report_boot_timings);
+  RUN_TEST(test_remote_change_does_not_redraw_matrix);
+  RUN_TEST(test_remote_change_is_not_announced);
+  RUN_TEST(test_malloc_is_counted);
+  RUN_TEST(test_soak_does_not_allocate);
+  return UNITY_END();
+}
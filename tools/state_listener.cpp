@@ -0,0 +1,130 @@
+// 状態アナウンス（main.cpp の announceState()）を受信して表示する Linux 用のサンプル
+//
+// ビルド:  g++ -std=c++11 -O2 -o state_listener tools/state_listener.cpp
+// 実行:    ./state_listener                 （ブロードキャストを受信）
+//          ./state_listener 239.255.42.1    （マルチキャストのグループに参加して受信）
+//
+// 状態が変わったとき（状態番号が変わったとき）だけ1行表示する。
+// ボードから3秒以上届かなければ警告を表示する。
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+const int ANNOUNCE_PORT = 4211;
+const int ANNOUNCE_HEADER_SIZE = 10;
+const int ANNOUNCE_ENTRY_SIZE = 4;
+const int MAX_NODES = 256;
+const time_t SILENCE_WARN_SEC = 3;
+
+struct NodeState {
+  bool seen;
+  uint32_t seq;      // 最後に表示した状態番号
+  time_t lastSeen;   // 最後に受信した時刻
+  bool warned;       // 途絶の警告を出したか
+};
+NodeState nodes[MAX_NODES];
+
+static uint16_t getU16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+static uint32_t getU32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void printPacket(const uint8_t* buf, int len) {
+  int node = buf[4];
+  uint32_t seq = getU32(buf + 5);
+  int count = buf[9];
+  printf("node %d seq %u", node, seq);
+  const uint8_t* p = buf + ANNOUNCE_HEADER_SIZE;
+  for (int i = 0; i < count && p + ANNOUNCE_ENTRY_SIZE <= buf + len; i++) {
+    int room = getU16(p);
+    uint16_t mask = getU16(p + 2);
+    printf("  %d:[", room);
+    bool first = true;
+    for (int box = 1; box <= 16; box++) {
+      if (mask & (1u << (box - 1))) {
+        printf(first ? "%d" : ",%d", box);
+        first = false;
+      }
+    }
+    printf("]");
+    p += ANNOUNCE_ENTRY_SIZE;
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(ANNOUNCE_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+
+  if (argc > 1) {
+    ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    if (inet_pton(AF_INET, argv[1], &mreq.imr_multiaddr) != 1) {
+      fprintf(stderr, "invalid group: %s\n", argv[1]);
+      return 1;
+    }
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      perror("IP_ADD_MEMBERSHIP");
+      return 1;
+    }
+  }
+
+  // 途絶を検出するため、受信は1秒でタイムアウトさせる
+  timeval tv = {1, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  printf("listening on UDP %d\n", ANNOUNCE_PORT);
+  fflush(stdout);
+
+  uint8_t buf[512];
+  for (;;) {
+    int len = recv(sock, buf, sizeof(buf), 0);
+    time_t now = time(nullptr);
+
+    if (len >= ANNOUNCE_HEADER_SIZE && buf[0] == 'M' && buf[1] == 'D' && buf[2] == 'A' && buf[3] == 1) {
+      NodeState &n = nodes[buf[4]];
+      uint32_t seq = getU32(buf + 5);
+      if (!n.seen || n.seq != seq || n.warned) {
+        printPacket(buf, len);
+      }
+      n.seen = true;
+      n.seq = seq;
+      n.lastSeen = now;
+      n.warned = false;
+    }
+
+    for (int i = 0; i < MAX_NODES; i++) {
+      NodeState &n = nodes[i];
+      if (n.seen && !n.warned && now - n.lastSeen >= SILENCE_WARN_SEC) {
+        printf("node %d: no announcement for %ld s\n", i, (long)(now - n.lastSeen));
+        fflush(stdout);
+        n.warned = true;
+      }
+    }
+  }
+}